@@ -15,70 +15,723 @@
 #define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/iterator_range.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
 #include "llvm/ExecutionEngine/Orc/LambdaResolver.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Mangler.h"
+#include "llvm/Support/CachePruning.h"
 #include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/SHA1.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 namespace llvm {
 namespace orc {
 
+// ObjectFileCache - object code kept on disk across runs, so that a module
+// compiled by an earlier run is loaded instead of compiled again. Entries are
+// keyed on a hash of the module's bitcode, taken as it reaches the code
+// generator, that is after optimization, and of the code generator's
+// configuration. Each entry records a hash of its object code, which is
+// checked before the object is used; an entry that fails the check is
+// deleted and counted as rejected. The least recently used entries are
+// evicted to keep the directory under its size limit.
+//
+// Any number of threads and processes can share a cache directory: entries
+// are written to a temporary file and renamed into place.
+class ObjectFileCache : public ObjectCache {
+public:
+  using Hash = std::array<uint8_t, 20>;
+
+  struct Stats {
+    uint64_t Hits, Misses, Rejected, Stored;
+  };
+
+  ~ObjectFileCache() override { prune(); }
+
+  // enable - start caching in Dir the code of TM, or of TargetMachines
+  // configured just like it, keeping the directory to MaxBytes
+  std::error_code enable(StringRef Dir, const TargetMachine &TM,
+                         uint64_t MaxBytes) {
+    if (auto EC = sys::fs::create_directories(Dir))
+      return EC;
+    this->Dir = Dir.str();
+    this->MaxBytes = MaxBytes;
+
+    // anything besides the IR that changes the object code
+    raw_string_ostream OS(Config);
+    OS << LLVM_VERSION_STRING << '\0' << TM.getTargetTriple().str() << '\0'
+       << TM.getTargetCPU() << '\0' << TM.getTargetFeatureString() << '\0'
+       << (int)TM.getOptLevel() << ' ' << (int)TM.getRelocationModel() << ' '
+       << (int)TM.getCodeModel() << ' ' << TM.Options.UnsafeFPMath
+       << TM.Options.NoInfsFPMath << TM.Options.NoNaNsFPMath
+       << TM.Options.NoSignedZerosFPMath << ' '
+       << (int)TM.Options.AllowFPOpFusion << '\0';
+    OS.flush();
+
+    prune();
+    return std::error_code();
+  }
+
+  bool isEnabled() const { return !Dir.empty(); }
+
+  Stats getStats() const { return {Hits, Misses, Rejected, Stored}; }
+
+  std::unique_ptr<MemoryBuffer> getObject(const Module *M) override {
+    if (!isEnabled())
+      return nullptr;
+    Hash Key = computeKey(*M);
+    SmallString<128> Path = entryPath(Key);
+
+    int FD;
+    if (sys::fs::openFileForRead(Path, FD)) {
+      rememberKey(M, Key);
+      ++Misses;
+      return nullptr;
+    }
+    auto Entry = MemoryBuffer::getOpenFile(FD, Path, -1, false);
+    // mark it used, for eviction, whatever the file system does with atimes
+    if (Entry)
+      sys::fs::setLastModificationAndAccessTime(
+          FD, std::chrono::system_clock::now());
+    sys::Process::SafelyCloseFileDescriptor(FD);
+
+    StringRef Object;
+    if (!Entry || !readEntry((*Entry)->getBuffer(), Key, Object)) {
+      sys::fs::remove(Path);
+      rememberKey(M, Key);
+      ++Rejected;
+      ++Misses;
+      return nullptr;
+    }
+    ++Hits;
+    return MemoryBuffer::getMemBufferCopy(Object, Path);
+  }
+
+  void notifyObjectCompiled(const Module *M, MemoryBufferRef Obj) override {
+    if (!isEnabled())
+      return;
+    Hash Key;
+    {
+      std::lock_guard<std::mutex> Lock(PendingMutex);
+      auto I = PendingKeys.find(M);
+      if (I == PendingKeys.end())
+        return;
+      Key = I->second;
+      PendingKeys.erase(I);
+    }
+
+    // write it where no reader looks, then rename it into place
+    auto Temp = sys::fs::TempFile::create(Dir + "/tmp-%%%%%%%%");
+    if (!Temp) {
+      consumeError(Temp.takeError());
+      return;
+    }
+    bool Failed;
+    {
+      raw_fd_ostream OS(Temp->FD, /*shouldClose=*/false);
+      Hash Sum = SHA1::hash(arrayRefFromStringRef(Obj.getBuffer()));
+      OS << magic() << toStringRef(makeArrayRef(Key))
+         << toStringRef(makeArrayRef(Sum)) << Obj.getBuffer();
+      OS.flush();
+      Failed = OS.has_error();
+      OS.clear_error();
+    }
+    if (Failed) {
+      consumeError(Temp->discard());
+      return;
+    }
+    if (auto Err = Temp->keep(entryPath(Key))) {
+      consumeError(std::move(Err));
+      return;
+    }
+    ++Stored;
+  }
+
+private:
+  // an entry is magic(), the key, a hash of the object code, then the object
+  static StringRef magic() { return "KALOBJ01"; }
+  static const size_t HeaderSize = 8 + 2 * sizeof(Hash);
+
+  Hash computeKey(const Module &M) {
+    SmallVector<char, 0> Buffer(Config.begin(), Config.end());
+    raw_svector_ostream OS(Buffer);
+    WriteBitcodeToFile(M, OS);
+    return SHA1::hash(
+        makeArrayRef((const uint8_t *)Buffer.data(), Buffer.size()));
+  }
+
+  SmallString<128> entryPath(const Hash &Key) {
+    // pruneCache only considers files with this prefix
+    SmallString<128> Path(Dir);
+    sys::path::append(Path, "llvmcache-" + toHex(Key));
+    return Path;
+  }
+
+  // rememberKey - M is about to be compiled, notifyObjectCompiled will want
+  // its key
+  void rememberKey(const Module *M, const Hash &Key) {
+    std::lock_guard<std::mutex> Lock(PendingMutex);
+    PendingKeys[M] = Key;
+  }
+
+  // readEntry - check that Entry is intact and is the entry for Key, and
+  // find its object code
+  static bool readEntry(StringRef Entry, const Hash &Key, StringRef &Object) {
+    if (Entry.size() < HeaderSize || !Entry.startswith(magic()))
+      return false;
+    StringRef EntryKey = Entry.substr(magic().size(), sizeof(Hash));
+    StringRef Sum = Entry.substr(magic().size() + sizeof(Hash), sizeof(Hash));
+    Object = Entry.drop_front(HeaderSize);
+    Hash ObjectSum = SHA1::hash(arrayRefFromStringRef(Object));
+    return EntryKey == toStringRef(makeArrayRef(Key)) &&
+           Sum == toStringRef(makeArrayRef(ObjectSum));
+  }
+
+  // prune - evict the least recently used entries, and any unused for a
+  // week, until the directory is under its size limit
+  void prune() {
+    if (!isEnabled())
+      return;
+    CachePruningPolicy Policy;
+    Policy.Interval = std::chrono::seconds(0);
+    Policy.MaxSizeBytes = MaxBytes;
+    pruneCache(Dir, Policy);
+  }
+
+  std::string Dir;
+  uint64_t MaxBytes = 0;
+  std::string Config;
+  std::mutex PendingMutex;
+  std::map<const Module *, Hash> PendingKeys;
+  std::atomic<uint64_t> Hits{0}, Misses{0}, Rejected{0}, Stored{0};
+};
+
 class KaleidoscopeJIT {
 public:
   using ObjLayerT = RTDyldObjectLinkingLayer;
   using CompileLayerT = IRCompileLayer<ObjLayerT, SimpleCompiler>;
+  using OptimizeFunction = std::function<void(Module &, TargetMachine &)>;
 
-  KaleidoscopeJIT()
+  // the code is generated for CPU with Features (+feature or -feature), or
+  // for a generic CPU of the host's architecture if CPU is empty
+  KaleidoscopeJIT(StringRef CPU = "", ArrayRef<std::string> Features = None)
       : ES(SSP),
         Resolver(createLegacyLookupResolver(
-            [this](const std::string &Name) {
+            [this](const std::string &Name) -> JITSymbol {
+              // a lazily added function is called through its stub
+              if (auto Sym = IndirectStubsMgr->findStub(Name, true))
+                return Sym;
               return ObjectLayer.findSymbol(Name, true);
             },
             [](Error Err) { cantFail(std::move(Err), "lookupFlags failed"); })),
-        TM(EngineBuilder().selectTarget()), DL(TM->createDataLayout()),
+        CPU(CPU), Features(Features.begin(), Features.end()),
+        TM(createTargetMachine()), DL(TM->createDataLayout()),
         ObjectLayer(ES,
                     [this](VModuleKey) {
                       return ObjLayerT::Resources{
                           std::make_shared<SectionMemoryManager>(), Resolver};
                     }),
-        CompileLayer(ObjectLayer, SimpleCompiler(*TM)) {
+        CompileLayer(ObjectLayer, SimpleCompiler(*TM, &ObjCache)),
+        CompileCallbackMgr(
+            createLocalCompileCallbackManager(TM->getTargetTriple(), ES, 0)),
+        IndirectStubsMgr(
+            createLocalIndirectStubsManagerBuilder(TM->getTargetTriple())()) {
     llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
   }
 
+  ~KaleidoscopeJIT() {
+    {
+      std::lock_guard<std::mutex> Lock(SpeculationMutex);
+      StopSpeculating = true;
+    }
+    SpeculationCV.notify_all();
+    for (auto &Worker : SpeculationWorkers)
+      Worker.join();
+  }
+
   TargetMachine &getTargetMachine() { return *TM; }
 
+  // createTargetMachine - a new TargetMachine for the CPU and features this
+  // JIT generates code for, for a compiler on another thread
+  TargetMachine *
+  createTargetMachine(CodeGenOpt::Level OptLevel = CodeGenOpt::Default) {
+    return EngineBuilder()
+        .setOptLevel(OptLevel)
+        .setMCPU(CPU)
+        .setMAttrs(Features)
+        .selectTarget();
+  }
+
+  // enableObjectCache - keep the object code of the modules compiled from now
+  // on in Dir, and load it from there instead of compiling a module again,
+  // keeping the directory to MaxBytes. Tiered compilation's code isn't
+  // cached: its first tier has the addresses of its counters built in.
+  std::error_code enableObjectCache(StringRef Dir, uint64_t MaxBytes) {
+    return ObjCache.enable(Dir, *TM, MaxBytes);
+  }
+
+  // getObjectCache - the cache, for compiling with a TargetMachine
+  // configured like this JIT's, or null if it isn't enabled
+  ObjectFileCache *getObjectCache() {
+    return ObjCache.isEnabled() ? &ObjCache : nullptr;
+  }
+
+  // getMutex - held by everything that changes the JIT's modules, stubs and
+  // layers. That includes the compiles that the first call of a lazily added
+  // function and the tier-up of a hot one set off, which run on whichever
+  // thread made the call. They work on the lazy module in place, so a host
+  // that generates IR in that module's context while JIT code may be running
+  // on other threads must hold it too.
+  std::recursive_mutex &getMutex() { return JITMutex; }
+
   VModuleKey addModule(std::unique_ptr<Module> M) {
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
     auto K = ES.allocateVModule();
     cantFail(CompileLayer.addModule(K, std::move(M)));
     ModuleKeys.push_back(K);
     return K;
   }
 
+  // addObject - add object code compiled elsewhere, say by a SimpleCompiler
+  // with a TargetMachine of its own on another thread
+  VModuleKey addObject(std::unique_ptr<MemoryBuffer> Obj) {
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+    auto K = ES.allocateVModule();
+    cantFail(ObjectLayer.addObject(K, std::move(Obj)));
+    ModuleKeys.push_back(K);
+    return K;
+  }
+
   void removeModule(VModuleKey K) {
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
     ModuleKeys.erase(find(ModuleKeys, K));
     cantFail(CompileLayer.removeModule(K));
   }
 
+  // enableTiering - compile the functions added lazily from now on in two
+  // tiers. The first tier is generated quickly, without optimization in the
+  // code generator, and counts the function's calls and loop iterations. When
+  // either count reaches its threshold, the function is recompiled from its
+  // original IR with OptimizeHot and an aggressive code generator, and its
+  // stub is pointed at the new body. That is a single pointer store, so
+  // callers switch atomically and activations of the first tier body run to
+  // completion undisturbed.
+  void enableTiering(OptimizeFunction OptimizeHot, uint64_t CallThreshold,
+                     uint64_t LoopThreshold) {
+    FastTM.reset(createTargetMachine(CodeGenOpt::None));
+    HotTM.reset(createTargetMachine(CodeGenOpt::Aggressive));
+    FastCompileLayer =
+        llvm::make_unique<CompileLayerT>(ObjectLayer, SimpleCompiler(*FastTM));
+    HotCompileLayer =
+        llvm::make_unique<CompileLayerT>(ObjectLayer, SimpleCompiler(*HotTM));
+    this->OptimizeHot = std::move(OptimizeHot);
+    this->CallThreshold = CallThreshold;
+    this->LoopThreshold = LoopThreshold;
+  }
+
+  // getNumTierUps - how many functions have been recompiled as hot
+  unsigned getNumTierUps() const { return NumTierUps; }
+
+  // enableSpeculation - when a module is added lazily, compile the lazily
+  // added functions it calls on NumThreads background threads, so that
+  // their first call finds them compiled and only has to link them. Each
+  // thread works on a copy of the module, read back from bitcode into a
+  // context of its own, and has its own TargetMachine, so the only shared
+  // state is the queue. Doesn't apply to tiered compilation, whose first
+  // tier is cheap to compile anyway.
+  void enableSpeculation(unsigned NumThreads) {
+    for (unsigned I = 0; I != NumThreads; ++I) {
+      SpeculationTMs.emplace_back(createTargetMachine());
+      TargetMachine &WorkerTM = *SpeculationTMs.back();
+      SpeculationWorkers.emplace_back(
+          [this, &WorkerTM] { speculationWorker(WorkerTM); });
+    }
+  }
+
+  // SpeculationStats - how the first calls of lazily added functions went:
+  // Hits found them compiled (or being compiled) in the background, Misses
+  // had to compile them on the spot, and Wasted counts background compiles
+  // that nothing has linked, because the functions weren't called or were
+  // redefined first
+  struct SpeculationStats {
+    unsigned Hits, Misses, Wasted;
+  };
+
+  SpeculationStats getSpeculationStats() {
+    std::lock_guard<std::mutex> Lock(SpeculationMutex);
+    SpeculationStats Stats = {NumSpeculationHits, NumSpeculationMisses, 0};
+    for (auto &LM : Speculated)
+      if (LM->Spec == Spec_Ready)
+        ++Stats.Wasted;
+    return Stats;
+  }
+
+  // addLazyModule - add M without compiling it. Every function M defines gets
+  // a stub that compiles M the first time one of them is called, and from
+  // then on jumps straight to the compiled body, so functions that are never
+  // called cost nothing beyond their IR. Optimize, if given, is run over M
+  // just before it is compiled.
+  void addLazyModule(std::unique_ptr<Module> M,
+                     OptimizeFunction Optimize = OptimizeFunction()) {
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+    auto LM = std::make_shared<LazyModule>();
+    LM->Key = ES.allocateVModule();
+    LM->Optimize = std::move(Optimize);
+    for (auto &F : *M)
+      if (!F.isDeclaration())
+        LM->Functions.push_back(F.getName().str());
+    LM->M = std::move(M);
+
+    for (auto &Name : LM->Functions) {
+      // the function's first call ends up here, compiles the module and
+      // continues into the body
+      auto CompileAction = [this, LM, Name]() {
+        std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+        materialize(LM);
+        return cantFail(
+            findMangledSymbol(mangle(implName(Name, LM->Key))).getAddress());
+      };
+      JITTargetAddress CallbackAddr = cantFail(
+          CompileCallbackMgr->getCompileCallback(std::move(CompileAction)));
+
+      // a redefinition reuses the stub, so existing callers get the new body
+      LazyDefinitions[Name] = LM;
+      std::string StubName = mangle(Name);
+      if (IndirectStubsMgr->findStub(StubName, false))
+        cantFail(IndirectStubsMgr->updatePointer(StubName, CallbackAddr));
+      else
+        cantFail(IndirectStubsMgr->createStub(StubName, CallbackAddr,
+                                              JITSymbolFlags::Exported));
+    }
+
+    // the functions it calls are likely to be called soon
+    if (!SpeculationWorkers.empty() && !FastCompileLayer)
+      for (auto &F : *LM->M)
+        if (F.isDeclaration() && !F.use_empty()) {
+          auto I = LazyDefinitions.find(F.getName());
+          if (I != LazyDefinitions.end())
+            speculate(I->second);
+        }
+  }
+
+  // findSymbol - Name's symbol, already resolved: getting the address of a
+  // symbol finalizes the object defining it, which has to happen under the
+  // lock
   JITSymbol findSymbol(const std::string Name) {
-    return findMangledSymbol(mangle(Name));
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+    auto Sym = findMangledSymbol(mangle(Name));
+    if (!Sym)
+      return Sym;
+    auto Addr = Sym.getAddress();
+    if (!Addr)
+      return Addr.takeError();
+    return JITSymbol(*Addr, Sym.getFlags());
   }
 
 private:
+  // SpeculationState - where a lazy module is in the background threads'
+  // hands. Only ever changed with SpeculationMutex held.
+  enum SpeculationState {
+    Spec_None,      // not speculated on
+    Spec_Queued,    // Bitcode is waiting for a thread
+    Spec_Compiling, // a thread is compiling it
+    Spec_Ready,     // Object holds the result
+    Spec_Done,      // no longer the background threads' business
+  };
+
+  // LazyModule - a module added with addLazyModule that hasn't necessarily
+  // been compiled yet. M is null once it has. With tiering, Original keeps
+  // the IR as it was added, for recompiling hot functions from. With
+  // speculation, Bitcode is the copy of M a background thread compiles into
+  // Object.
+  struct LazyModule {
+    VModuleKey Key;
+    std::unique_ptr<Module> M;
+    std::unique_ptr<Module> Original;
+    std::vector<std::string> Functions;
+    OptimizeFunction Optimize;
+    SpeculationState Spec = Spec_None;
+    SmallVector<char, 0> Bitcode;
+    std::unique_ptr<MemoryBuffer> Object;
+  };
+
+  // TierState - the counters of a function's first tier body, which its
+  // instrumentation updates in place, and what it is recompiled from
+  struct TierState {
+    KaleidoscopeJIT *JIT;
+    std::shared_ptr<LazyModule> LM;
+    std::string Name;
+    uint64_t Calls = 0;
+    uint64_t Iterations = 0;
+    // the counters aren't atomic, so calls on several threads may each see
+    // a threshold reached
+    bool Recompiled = false;
+  };
+
+  // implName - the name a lazily compiled function's body is given, distinct
+  // from the stub's and from the bodies of earlier definitions
+  static std::string implName(StringRef Name, VModuleKey K) {
+    return (Name + "$" + Twine(K)).str();
+  }
+
+  // renameBodies - give the functions a lazy module defines the names of
+  // their bodies. Calls the module makes to them go through their stubs, like
+  // any other caller's, so that they see later redefinitions and, when
+  // tiered, reach the hot body once there is one.
+  static void renameBodies(Module &M, ArrayRef<std::string> Functions,
+                           VModuleKey K) {
+    for (auto &Name : Functions) {
+      Function *F = M.getFunction(Name);
+      Function *Decl = Function::Create(F->getFunctionType(),
+                                        Function::ExternalLinkage, "", &M);
+      F->replaceAllUsesWith(Decl);
+      F->setName(implName(Name, K));
+      Decl->setName(Name);
+    }
+  }
+
+  // speculate - queue LM for compiling in the background, unless it has
+  // been compiled or queued already
+  void speculate(const std::shared_ptr<LazyModule> &LM) {
+    {
+      std::lock_guard<std::mutex> Lock(SpeculationMutex);
+      if (!LM->M || LM->Spec != Spec_None)
+        return;
+    }
+    {
+      raw_svector_ostream OS(LM->Bitcode);
+      WriteBitcodeToFile(*LM->M, OS);
+    }
+    {
+      std::lock_guard<std::mutex> Lock(SpeculationMutex);
+      LM->Spec = Spec_Queued;
+      SpeculationQueue.push_back(LM);
+      Speculated.push_back(LM);
+    }
+    SpeculationCV.notify_one();
+  }
+
+  // speculationWorker - a background thread's loop: compile queued modules
+  // until the JIT is destroyed
+  void speculationWorker(TargetMachine &WorkerTM) {
+    std::unique_lock<std::mutex> Lock(SpeculationMutex);
+    while (true) {
+      SpeculationCV.wait(Lock, [this] {
+        return StopSpeculating || !SpeculationQueue.empty();
+      });
+      if (StopSpeculating)
+        return;
+      auto LM = std::move(SpeculationQueue.front());
+      SpeculationQueue.pop_front();
+      if (LM->Spec != Spec_Queued)
+        continue; // its first call came first
+
+      // once Compiling, nothing else touches LM's Key, Functions, Optimize
+      // or Bitcode
+      LM->Spec = Spec_Compiling;
+      Lock.unlock();
+      LLVMContext Ctx;
+      auto M = cantFail(parseBitcodeFile(
+          MemoryBufferRef(StringRef(LM->Bitcode.data(), LM->Bitcode.size()),
+                          "speculative"),
+          Ctx));
+      renameBodies(*M, LM->Functions, LM->Key);
+      if (LM->Optimize)
+        LM->Optimize(*M, WorkerTM);
+      auto Object = SimpleCompiler(WorkerTM, &ObjCache)(*M);
+      M.reset();
+      Lock.lock();
+
+      LM->Object = std::move(Object);
+      LM->Spec = Spec_Ready;
+      SpeculationCV.notify_all();
+    }
+  }
+
+  // takeSpeculativeObject - LM's object code compiled in the background,
+  // waiting for it if a thread is on it right now, or null if it has to be
+  // compiled here. Either way the background threads are done with LM.
+  std::unique_ptr<MemoryBuffer> takeSpeculativeObject(LazyModule &LM) {
+    std::unique_lock<std::mutex> Lock(SpeculationMutex);
+    SpeculationCV.wait(Lock, [&] { return LM.Spec != Spec_Compiling; });
+    bool Hit = LM.Spec == Spec_Ready;
+    LM.Spec = Spec_Done;
+    LM.Bitcode.clear();
+    if (!Hit) {
+      ++NumSpeculationMisses;
+      return nullptr;
+    }
+    ++NumSpeculationHits;
+    return std::move(LM.Object);
+  }
+
+  // materialize - compile a lazy module and point the stubs of the functions
+  // it still defines at their bodies
+  void materialize(const std::shared_ptr<LazyModule> &LMPtr) {
+    LazyModule &LM = *LMPtr;
+    if (!LM.M)
+      return;
+
+    std::unique_ptr<MemoryBuffer> Object;
+    if (!SpeculationWorkers.empty() && !FastCompileLayer)
+      Object = takeSpeculativeObject(LM);
+    if (Object) {
+      cantFail(ObjectLayer.addObject(LM.Key, std::move(Object)));
+      LM.M.reset();
+      ModuleKeys.push_back(LM.Key);
+      pointStubsAtBodies(LM);
+      return;
+    }
+
+    bool Tiered = FastCompileLayer != nullptr;
+    if (Tiered)
+      LM.Original = CloneModule(*LM.M);
+
+    renameBodies(*LM.M, LM.Functions, LM.Key);
+    if (LM.Optimize)
+      LM.Optimize(*LM.M, *TM);
+
+    if (Tiered) {
+      for (auto &Name : LM.Functions) {
+        TierStates.push_back(llvm::make_unique<TierState>());
+        TierState &TS = *TierStates.back();
+        TS.JIT = this;
+        TS.LM = LMPtr;
+        TS.Name = Name;
+        instrument(*LM.M->getFunction(implName(Name, LM.Key)), TS);
+      }
+      cantFail(FastCompileLayer->addModule(LM.Key, std::move(LM.M)));
+    } else {
+      cantFail(CompileLayer.addModule(LM.Key, std::move(LM.M)));
+    }
+    ModuleKeys.push_back(LM.Key);
+    pointStubsAtBodies(LM);
+  }
+
+  // pointStubsAtBodies - make the stubs of the functions a just compiled lazy
+  // module still defines jump straight to their bodies
+  void pointStubsAtBodies(LazyModule &LM) {
+    for (auto &Name : LM.Functions) {
+      if (LazyDefinitions[Name].get() != &LM)
+        continue; // redefined since
+      auto Body = findMangledSymbol(mangle(implName(Name, LM.Key)));
+      cantFail(IndirectStubsMgr->updatePointer(mangle(Name),
+                                               cantFail(Body.getAddress())));
+    }
+  }
+
+  // instrument - count the calls to F, a first tier body, and the iterations
+  // of its loops in TS. The count that reaches its threshold first calls
+  // tierUp, once.
+  void instrument(Function &F, TierState &TS) {
+    LLVMContext &Ctx = F.getContext();
+    Type *Int64Ty = Type::getInt64Ty(Ctx);
+    auto getPointer = [&](void *P, Type *Ty) {
+      return ConstantExpr::getIntToPtr(
+          ConstantInt::get(Int64Ty, (uint64_t)(uintptr_t)P), Ty);
+    };
+    FunctionType *HookTy = FunctionType::get(
+        Type::getVoidTy(Ctx), {Type::getInt8PtrTy(Ctx)}, false);
+    Constant *Hook =
+        getPointer((void *)&tierUpHook, HookTy->getPointerTo());
+    Constant *State = getPointer(&TS, Type::getInt8PtrTy(Ctx));
+
+    auto count = [&](Instruction *Before, uint64_t *Counter,
+                     uint64_t Threshold) {
+      IRBuilder<> B(Before);
+      Value *Ptr = getPointer(Counter, Int64Ty->getPointerTo());
+      Value *N = B.CreateAdd(B.CreateLoad(Ptr), B.getInt64(1));
+      B.CreateStore(N, Ptr);
+      Value *Hot = B.CreateICmpEQ(N, B.getInt64(Threshold));
+      IRBuilder<>(SplitBlockAndInsertIfThen(Hot, Before, false))
+          .CreateCall(HookTy, Hook, State);
+    };
+
+    // a block with an edge back to a block that dominates it ends an
+    // iteration of a loop. Find them all before splitting any.
+    DominatorTree DT(F);
+    SmallVector<BasicBlock *, 4> Latches;
+    for (auto &BB : F)
+      for (BasicBlock *Succ : successors(&BB))
+        if (DT.dominates(Succ, &BB)) {
+          Latches.push_back(&BB);
+          break;
+        }
+
+    for (BasicBlock *BB : Latches)
+      count(BB->getTerminator(), &TS.Iterations, LoopThreshold);
+    count(&*F.getEntryBlock().getFirstInsertionPt(), &TS.Calls,
+          CallThreshold);
+  }
+
+  static void tierUpHook(TierState *TS) { TS->JIT->tierUp(*TS); }
+
+  // tierUp - recompile a hot function from its original IR, alone in a
+  // module of its own, and point its stub at the result
+  void tierUp(TierState &TS) {
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+    if (TS.Recompiled)
+      return;
+    TS.Recompiled = true;
+    if (LazyDefinitions[TS.Name] != TS.LM)
+      return; // redefined since, the new definition starts at the first tier
+
+    ValueToValueMapTy VMap;
+    auto M = CloneModule(*TS.LM->Original, VMap,
+                         [&](const GlobalValue *GV) {
+                           return GV->getName() == TS.Name;
+                         });
+    auto K = ES.allocateVModule();
+    M->getFunction(TS.Name)->setName(implName(TS.Name, K));
+    if (OptimizeHot)
+      OptimizeHot(*M, *HotTM);
+    cantFail(HotCompileLayer->addModule(K, std::move(M)));
+    ModuleKeys.push_back(K);
+
+    auto Body = findMangledSymbol(mangle(implName(TS.Name, K)));
+    cantFail(IndirectStubsMgr->updatePointer(mangle(TS.Name),
+                                             cantFail(Body.getAddress())));
+    ++NumTierUps;
+  }
+
   std::string mangle(const std::string &Name) {
     std::string MangledName;
     {
@@ -102,6 +755,10 @@ private:
     const bool ExportedSymbolsOnly = true;
 #endif
 
+    // Lazily added functions are only known by their stubs.
+    if (auto Sym = IndirectStubsMgr->findStub(Name, ExportedSymbolsOnly))
+      return Sym;
+
     // Search modules in reverse order: from last added to first added.
     // This is the opposite of the usual search order for dlsym, but makes more
     // sense in a REPL where we want to bind to the newest available definition.
@@ -129,11 +786,40 @@ private:
   SymbolStringPool SSP;
   ExecutionSession ES;
   std::shared_ptr<SymbolResolver> Resolver;
+  std::string CPU;
+  std::vector<std::string> Features;
   std::unique_ptr<TargetMachine> TM;
   const DataLayout DL;
+  ObjectFileCache ObjCache;
+  // JITMutex - see getMutex. Recursive, as finalizing an object resolves its
+  // symbols through the JIT, and code the lock holder runs may call a lazy
+  // function's stub.
+  std::recursive_mutex JITMutex;
   ObjLayerT ObjectLayer;
   CompileLayerT CompileLayer;
   std::vector<VModuleKey> ModuleKeys;
+  std::unique_ptr<JITCompileCallbackManager> CompileCallbackMgr;
+  std::unique_ptr<IndirectStubsManager> IndirectStubsMgr;
+  StringMap<std::shared_ptr<LazyModule>> LazyDefinitions;
+
+  // the tiered JIT's code generators, null unless enableTiering was called
+  std::unique_ptr<TargetMachine> FastTM, HotTM;
+  std::unique_ptr<CompileLayerT> FastCompileLayer, HotCompileLayer;
+  OptimizeFunction OptimizeHot;
+  uint64_t CallThreshold = 0, LoopThreshold = 0;
+  std::vector<std::unique_ptr<TierState>> TierStates;
+  unsigned NumTierUps = 0;
+
+  // speculative compilation, see enableSpeculation. Speculated is every
+  // module ever queued, for counting the wasted compiles.
+  std::vector<std::unique_ptr<TargetMachine>> SpeculationTMs;
+  std::vector<std::thread> SpeculationWorkers;
+  std::mutex SpeculationMutex;
+  std::condition_variable SpeculationCV;
+  std::deque<std::shared_ptr<LazyModule>> SpeculationQueue;
+  std::vector<std::shared_ptr<LazyModule>> Speculated;
+  bool StopSpeculating = false;
+  unsigned NumSpeculationHits = 0, NumSpeculationMisses = 0;
 };
 
 } // end namespace orc
@@ -5,40 +5,77 @@
 */
 
 #include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
 #include "llvm/ADT/Optional.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/DiagnosticHandler.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/MC/MCSubtargetInfo.h"
+#include "llvm/Pass.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/Host.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/Timer.h"
 #include "llvm/Target/TargetOptions.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Transforms/InstCombine/InstCombine.h"
-#include "llvm/Transforms/Scalar.h"
-#include "llvm/Transforms/Scalar/GVN.h"
-#include "llvm/Transforms/Utils.h"
+#include "llvm/Transforms/Scalar/LoopUnrollPass.h"
+#include "llvm/Transforms/Scalar/NewGVN.h"
+#include "llvm/Transforms/Scalar/Reassociate.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/Mem2Reg.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Transforms/Vectorize/LoopVectorize.h"
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
+#include <cmath>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
-#include <map>
+#include <cstring>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <system_error>
+#include <thread>
 #include <utility>
 #include <vector>
 #include "KaleidoscopeJIT.h"
@@ -47,13 +84,327 @@ using namespace llvm;
 using namespace llvm::orc;
 using namespace llvm::sys;
 
-static LLVMContext TheContext;
-static IRBuilder<> Builder(TheContext);
-static std::unique_ptr<Module> TheModule;
-static std::map<std::string, AllocaInst*> NamedValues;
-static std::unique_ptr<KaleidoscopeJIT> TheJIT;
-static std::unique_ptr<legacy::FunctionPassManager> TheFPM;
+static cl::opt<std::string> InputFilename(cl::Positional,
+                                          cl::desc("<input file>"),
+                                          cl::init("-"));
+static cl::opt<bool> LexOnly("lex-only",
+                             cl::desc("Only lex the input and report the "
+                                      "lexer's throughput"));
+static cl::opt<bool> ParseOnly("parse-only",
+                               cl::desc("Only parse the input and report the "
+                                        "parser's throughput"));
+// CompilerOptions - how a CompilerSession compiles. Each session has its
+// own, fixed when it is made; main's come from the flags below, which are
+// described there. main checks them with checkPipelineOptions and
+// checkMathOptions first; a session ignores an unknown fast-math flag.
+struct CompilerOptions {
+    bool HashCons = true;
+    bool DirectSSA = true;
+    bool LazyCompile = false;
+    unsigned SpeculateThreads = 0;
+    bool Tiered = false;
+    unsigned TierUpCalls = 100;
+    unsigned TierUpIterations = 10000;
+    unsigned BatchSize = 64;
+    unsigned Jobs = 0;
+    std::string ObjectCacheDir; // empty for no object cache
+    unsigned ObjectCacheSize = 512; // in MB
+    unsigned ExprCacheSize = 64;
+    bool Interpret = true;
+    int OptLevel = -1; // -1 for per-function optimization, see modulePipeline
+    std::string PassPipeline;
+    unsigned ImportSize = 100;
+    bool LoopRemarks = false;
+    std::string FastMath;
+    std::string MCPU;
+    std::vector<std::string> MAttrs;
+    bool EmitDefinitions = false;
+    std::vector<std::string> Multiversion;
+};
+
+// CommandLineOptions - the options main's session is made with. The flags
+// store into it, and their defaults are its members' initial values.
+static CompilerOptions CommandLineOptions;
+
+static cl::opt<bool, true>
+    HashConsFlag("hash-cons",
+                 cl::desc("Share identical side effect free "
+                          "subexpressions and generate them once"),
+                 cl::location(CommandLineOptions.HashCons));
+static cl::opt<bool, true>
+    DirectSSAFlag("direct-ssa",
+                  cl::desc("Build SSA values and phi nodes for "
+                           "variables directly, instead of "
+                           "allocas for mem2reg to promote"),
+                  cl::location(CommandLineOptions.DirectSSA));
+static cl::opt<bool, true>
+    LazyCompileFlag("lazy",
+                    cl::desc("Compile and optimize each function "
+                             "on its first call instead of when "
+                             "it is defined"),
+                    cl::location(CommandLineOptions.LazyCompile));
+static cl::opt<unsigned, true>
+    SpeculateThreadsFlag("speculate",
+                         cl::desc("With -lazy, compile the functions each "
+                                  "definition calls on this many "
+                                  "background threads"),
+                         cl::location(CommandLineOptions.SpeculateThreads));
+static cl::opt<bool, true>
+    TieredFlag("tiered",
+               cl::desc("Compile each function quickly on its "
+                        "first call, and again at -O3 once it "
+                        "gets hot"),
+               cl::location(CommandLineOptions.Tiered));
+static cl::opt<unsigned, true>
+    TierUpCallsFlag("tier-up-calls",
+                    cl::desc("Calls after which -tiered "
+                             "recompiles a function"),
+                    cl::location(CommandLineOptions.TierUpCalls));
+static cl::opt<unsigned, true>
+    TierUpIterationsFlag("tier-up-iterations",
+                         cl::desc("Loop iterations after "
+                                  "which -tiered recompiles "
+                                  "a function"),
+                         cl::location(CommandLineOptions.TierUpIterations));
+static cl::opt<unsigned, true>
+    BatchSizeFlag("batch-size",
+                  cl::desc("When compiling a file, hand "
+                           "definitions to the JIT this "
+                           "many at a time, in one module"),
+                  cl::location(CommandLineOptions.BatchSize));
+static cl::opt<unsigned, true>
+    JobsFlag("jobs",
+             cl::desc("When compiling a file, parse, "
+                      "generate and optimize its definitions "
+                      "on this many threads"),
+             cl::location(CommandLineOptions.Jobs));
+static cl::opt<std::string, true>
+    ObjectCacheDirFlag("object-cache",
+                       cl::desc("Keep compiled object code in this "
+                                "directory and reuse it in later runs"),
+                       cl::value_desc("dir"),
+                       cl::location(CommandLineOptions.ObjectCacheDir));
+static cl::opt<unsigned, true>
+    ObjectCacheSizeFlag("object-cache-size",
+                        cl::desc("Size limit of the object "
+                                 "cache in MB"),
+                        cl::location(CommandLineOptions.ObjectCacheSize));
+static cl::opt<unsigned, true>
+    ExprCacheSizeFlag("expr-cache-size",
+                      cl::desc("Compiled top-level "
+                               "expressions to keep for "
+                               "when they come again "
+                               "(0 for none)"),
+                      cl::location(CommandLineOptions.ExprCacheSize));
+static cl::opt<bool, true>
+    InterpretFlag("interpret",
+                  cl::desc("Interpret top-level expressions "
+                           "without loops instead of JIT "
+                           "compiling them"),
+                  cl::location(CommandLineOptions.Interpret));
+static cl::opt<int, true>
+    OptLevelFlag("O", cl::Prefix,
+                 cl::desc("Optimize each module with the "
+                          "standard pipeline of this level, "
+                          "0 to 3, before compiling it"),
+                 cl::location(CommandLineOptions.OptLevel));
+static cl::opt<std::string, true>
+    PassPipelineFlag("passes",
+                     cl::desc("Optimize each module with "
+                              "this pipeline, in the "
+                              "syntax of opt -passes, "
+                              "before compiling it"),
+                     cl::value_desc("pipeline"),
+                     cl::location(CommandLineOptions.PassPipeline));
+static cl::opt<unsigned, true>
+    ImportSizeFlag("import-size",
+                   cl::desc("With -O or -passes, copy "
+                            "functions of at most this many "
+                            "instructions into the modules "
+                            "calling them, so that they can "
+                            "be inlined (0 for none)"),
+                   cl::location(CommandLineOptions.ImportSize));
+static cl::opt<bool, true>
+    LoopRemarksFlag("loop-remarks",
+                    cl::desc("Report the loops the vectorizer "
+                             "and unroller transformed, and "
+                             "why they left the others"),
+                    cl::location(CommandLineOptions.LoopRemarks));
+static cl::opt<std::string, true>
+    FastMathFlag("fast-math",
+                 cl::desc("Build floating point "
+                          "arithmetic with these "
+                          "fast-math flags, unless a "
+                          "definition lists its own: "
+                          "reassoc, nnan, ninf, nsz, "
+                          "arcp, contract, afn or fast"),
+                 cl::value_desc("flag,..."),
+                 cl::location(CommandLineOptions.FastMath));
+static cl::opt<std::string, true>
+    MCPUFlag("mcpu",
+             cl::desc("Generate code for this CPU, or "
+                      "native for the host's, in the JIT "
+                      "and in output.o (a generic CPU "
+                      "of the host's architecture by "
+                      "default)"),
+             cl::value_desc("cpu"), cl::location(CommandLineOptions.MCPU));
+static cl::list<std::string, std::vector<std::string>>
+    MAttrsFlag("mattr", cl::CommaSeparated,
+               cl::desc("Target features to enable "
+                        "(+feature) or disable "
+                        "(-feature) on top of the "
+                        "CPU's"),
+               cl::value_desc("+feature,..."),
+               cl::location(CommandLineOptions.MAttrs));
+static cl::opt<bool, true>
+    EmitDefinitionsFlag("emit-definitions",
+                        cl::desc("Write every definition "
+                                 "compiled to output.o, not "
+                                 "only those the JIT hasn't "
+                                 "been handed"),
+                        cl::location(CommandLineOptions.EmitDefinitions));
+static cl::list<std::string, std::vector<std::string>>
+    MultiversionFlag("multiversion", cl::CommaSeparated,
+                     cl::desc("In output.o, also "
+                              "compile the functions "
+                              "with loops for these "
+                              "CPUs, best first, and "
+                              "call the first the "
+                              "machine running it "
+                              "supports (implies "
+                              "-emit-definitions)"),
+                     cl::value_desc("cpu,..."),
+                     cl::location(CommandLineOptions.Multiversion));
+static cl::opt<std::string> BatchBench("batch-bench",
+                                      cl::desc("After compiling the input, "
+                                               "time evaluating this "
+                                               "function over columns of "
+                                               "arguments, calling it per "
+                                               "row and in a compiled loop"),
+                                      cl::value_desc("function"));
+static cl::opt<unsigned> BatchRows("batch-rows",
+                                   cl::desc("Rows -batch-bench evaluates the "
+                                            "function over"),
+                                   cl::init(1000000));
+static cl::opt<bool> TimePhases("time-phases",
+                                cl::desc("Report the time spent parsing, "
+                                         "simplifying, generating and "
+                                         "optimizing IR"));
+static cl::opt<bool> PrintStats("toy-stats",
+                                cl::desc("Print compilation statistics on "
+                                         "exit"));
+
+// Phase timers. They only run with -time-phases, and the group prints its
+// report on exit if any of them did.
+static TimerGroup PhaseTimers("toy", "Kaleidoscope phases");
+static Timer ParseTimer("parse", "Parsing", PhaseTimers);
+static Timer SimplifyTimer("simplify", "Expression simplification",
+                           PhaseTimers);
+static Timer CodegenTimer("codegen", "IR generation", PhaseTimers);
+static Timer OptTimer("opt", "Function optimization", PhaseTimers);
+static Timer HotOptTimer("opt-hot", "Hot function optimization", PhaseTimers);
+static Timer InterpTimer("interp", "Bytecode interpretation", PhaseTimers);
+
+// phaseTimer - the timer to pass to a TimeRegion, null unless timing. Timers
+// aren't thread safe, so work done on the JIT's background threads isn't
+// timed.
+static const std::thread::id MainThread = std::this_thread::get_id();
+static Timer *phaseTimer(Timer &T) {
+    return TimePhases && std::this_thread::get_id() == MainThread ? &T
+                                                                  : nullptr;
+}
+
+// Pass timers, one per optimization pass (or pipeline element, see
+// runPipeline), made as they are first run. LLVM's own -time-passes turns
+// them on, and it times the code generator's passes alongside.
+static TimerGroup PassTimerGroup("toy-passes", "Optimization passes");
+static StringMap<std::unique_ptr<Timer>> PassTimers;
+
+// passTimer - the timer for pass Name, null unless timing
+static Timer *passTimer(StringRef Name) {
+    if (!TimePassesIsEnabled || std::this_thread::get_id() != MainThread)
+        return nullptr;
+    auto &T = PassTimers[Name];
+    if (!T)
+        T = llvm::make_unique<Timer>(Name, Name, PassTimerGroup);
+    return T.get();
+}
+
+// AnalysisManagers - the new pass manager's analysis managers, registered
+// with each other and with the analyses PassBuilder knows
+struct AnalysisManagers {
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+
+    explicit AnalysisManagers(PassBuilder &PB) {
+        PB.registerModuleAnalyses(MAM);
+        PB.registerCGSCCAnalyses(CGAM);
+        PB.registerFunctionAnalyses(FAM);
+        PB.registerLoopAnalyses(LAM);
+        PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+    }
+};
+
+// FunctionOptimizer - the passes every function gets as it is generated,
+// and those only functions with loops get. With -time-passes each pass gets
+// a pass manager of its own, so that it can be timed.
+class FunctionOptimizer {
+    typedef std::vector<std::pair<StringRef, FunctionPassManager>> StageList;
+    PassBuilder PB;
+    AnalysisManagers AM;
+    StageList Stages, LoopStages;
+
+    template <typename PassT>
+    void add(StageList &List, StringRef Name, PassT Pass) {
+        if (List.empty() || TimePassesIsEnabled)
+            List.emplace_back(Name, FunctionPassManager());
+        List.back().second.addPass(std::move(Pass));
+    }
+    template <typename PassT> void add(StringRef Name, PassT Pass) {
+        add(Stages, Name, std::move(Pass));
+    }
+
+    void runStages(StageList &List, Function &F) {
+        for (auto &Stage : List) {
+            TimeRegion T(passTimer(Stage.first));
+            Stage.second.run(F, AM.FAM);
+        }
+    }
 
+public:
+    FunctionOptimizer(TargetMachine *TM, const CompilerOptions &Options)
+        : PB(TM), AM(PB) {
+        // Promote allocas to registers, unless codegen built SSA form directly
+        if (!Options.DirectSSA)
+            add("mem2reg", PromotePass());
+        // do simple 'peephole' optimizations and bit-twiddling optimizations
+        add("instcombine", InstCombinePass());
+        // reassociate expressions
+        add("reassociate", ReassociatePass());
+        // eliminate common subexpressions
+        add("newgvn", NewGVNPass());
+        // simplify the control flow graph (delete unreachable block, etc.)
+        add("simplifycfg", SimplifyCFGPass());
+
+        // vectorize and unroll loops, and clean up after them
+        add(LoopStages, "loop-vectorize", LoopVectorizePass());
+        add(LoopStages, "loop-unroll", LoopUnrollPass());
+        add(LoopStages, "instcombine", InstCombinePass());
+        add(LoopStages, "simplifycfg", SimplifyCFGPass());
+    }
+
+    void run(Function &F) {
+        runStages(Stages, F);
+        if (!AM.FAM.getResult<LoopAnalysis>(F).empty())
+            runStages(LoopStages, F);
+        // the results are keyed on F's address, which a later function may
+        // reuse
+        AM.FAM.clear();
+        AM.MAM.clear();
+    }
+};
 
 // lexer returns tokens [0-255] if it is an unknown character, otherwise one
 // of these for known things
@@ -83,185 +434,556 @@ enum Token {
     tok_var = -13,
 };
 
-static std::string IdentifierStr; // filled in if tok_identifier
-static double NumVal;              // filled in if tok_number
+// SourceBuffer - the text the lexer reads from. A file named on the command
+// line is mapped into memory in one go (MemoryBuffer mmaps anything big enough
+// to be worth it) and lexed in place. Otherwise stdin is pulled in a line at a
+// time so the REPL stays interactive. Either way the lexer walks a null
+// terminated run of characters [CurPtr, BufEnd) and hands out token text as
+// views into it rather than copies.
+class SourceBuffer {
+    std::unique_ptr<MemoryBuffer> File;
+    std::string Line;
+    FILE *Stream = nullptr;
 
-static int gettok() {
-    static int LastChar = ' ';
-
-    // skip any whitespace
-    while (isspace(LastChar))
-        LastChar = getchar();
-
-    if (isalpha(LastChar)){ // identifier: [a-zA-Z][a-zA-Z0-9]*
-        IdentifierStr = LastChar;
-        while (isalnum((LastChar = getchar())))
-            IdentifierStr += LastChar;
-        //printf("%s", IdentifierStr.c_str());
-        if (IdentifierStr == "def")
-            return tok_def;
-        if (IdentifierStr == "extern")
-            return tok_extern;
-        if (IdentifierStr == "if")
-            return tok_if;
-        if (IdentifierStr == "then")
-            return tok_then;
-        if (IdentifierStr == "else")
-            return tok_else;
-        if (IdentifierStr == "for")
-            return tok_for;
-        if (IdentifierStr == "in")
-            return tok_in;
-        if (IdentifierStr == "binary")
-            return tok_binary;
-        if (IdentifierStr == "unary")
-            return tok_unary;
-        if (IdentifierStr == "var")
-            return tok_var;
-        return tok_identifier;
-    }
-
-    if (isdigit(LastChar) || LastChar == '.'){  // Number: [0-9.]+
-        std::string NumStr;
-        do {
-            NumStr += LastChar;
-            LastChar = getchar();
-        } while ( isdigit(LastChar) || LastChar == '.');
-
-        NumVal = strtod(NumStr.c_str(), nullptr);
-        return tok_number;
+public:
+    const char *CurPtr = "";
+    const char *BufEnd = CurPtr;
+    const char *TokStart = CurPtr; // where the last token began
+    uint64_t BytesRead = 0; // total input seen so far, for throughput reports
+
+    // openFile - map Path into memory, returns false if it can't be read
+    bool openFile(StringRef Path) {
+        auto FileOrErr = MemoryBuffer::getFile(Path);
+        if (!FileOrErr) {
+            errs() << "Could not open " << Path << ": "
+                   << FileOrErr.getError().message() << "\n";
+            return false;
+        }
+        File = std::move(*FileOrErr);
+        CurPtr = File->getBufferStart();
+        BufEnd = File->getBufferEnd();
+        BytesRead = File->getBufferSize();
+        return true;
     }
 
-    if (LastChar == '#'){
-        // comment until end of line
-        do
-            LastChar = getchar();
-        while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
-
-        if (LastChar != EOF)
-            return gettok();
+    // openMemory - lex a copy of Text
+    void openMemory(StringRef Text) {
+        File = MemoryBuffer::getMemBufferCopy(Text);
+        Stream = nullptr;
+        CurPtr = File->getBufferStart();
+        BufEnd = File->getBufferEnd();
+        BytesRead += File->getBufferSize();
     }
 
-    if (LastChar == EOF)
-        return tok_eof;
+    // openStream - read from a stdio stream, a line at a time
+    void openStream(FILE *S) { Stream = S; }
 
-    int ThisChar = LastChar;
-    LastChar = getchar();
-    return ThisChar;
-}
+    // isInteractive - whether the input is being typed in
+    bool isInteractive() const { return Stream != nullptr; }
 
-namespace {
-// ExprAST - Base class for all expression nodes
-class ExprAST {
-public:
-    virtual ~ExprAST() = default;
-    virtual Value *codegen() = 0;
-};
+    // refill - called once CurPtr reaches BufEnd. Reads the next line of the
+    // stream, returning false at the end of input. Views into the previous
+    // line are invalidated, which is fine since no token spans a newline.
+    bool refill() {
+        if (!Stream)
+            return false;
 
-// NumberExprAST - Expression class for numeric literals like .0
-class NumberExprAST : public ExprAST {
-    double Val;
+        Line.clear();
+        char Chunk[4096];
+        while (fgets(Chunk, sizeof(Chunk), Stream)) {
+            Line += Chunk;
+            if (Line.back() == '\n')
+                break;
+        }
+        if (Line.empty())
+            return false;
 
-public:
-    NumberExprAST(double Val) : Val(Val) {}
-    Value *codegen() override;
+        CurPtr = Line.data();
+        BufEnd = CurPtr + Line.size();
+        BytesRead += Line.size();
+        return true;
+    }
 };
 
-// VariableExprAST - Expression class for refreencing a variable
-class VariableExprAST : public ExprAST {
-    std::string Name;
-
-public:
-    VariableExprAST(const std::string &Name) : Name(Name) {}
-    Value *codegen() override;
-    const std::string &getName() const { return Name; }
+// SymbolId - an identifier interned by the lexer. Every occurrence of a name
+// maps to the same small integer, so the parser and codegen compare and index
+// by it instead of hashing strings. 0 is never handed out.
+typedef uint32_t SymbolId;
+static const SymbolId NoSymbol = 0;
+
+// ExprId - index of an expression node in the expression table
+typedef uint32_t ExprId;
+static const ExprId NoExpr = ~0u;
+
+// ExprKind - the kinds of expression node. Each node has a 32 bit Data
+// payload whose meaning depends on the kind, and a list of operands.
+enum ExprKind : uint8_t {
+    Expr_Number,   // numeric literal like 1.0. Data indexes the number pool
+    Expr_Variable, // reference to a variable. Data is its SymbolId
+    Expr_Unary,    // Data is the opcode. Operands: operand
+    Expr_Binary,   // Data is the opcode. Operands: LHS, RHS
+    Expr_If,       // Operands: cond, then, else
+    Expr_For,      // Data is the loop variable's SymbolId.
+                   // Operands: init, cond, step (or NoExpr), body
+    Expr_Var,      // var/in. Data indexes the first variable's SymbolId in
+                   // the symbol pool, the others follow it. Operands: an
+                   // initializer (or NoExpr) per variable, then the body
+    Expr_Call,     // Data is the callee's SymbolId. Operands: the arguments
+    Expr_Index,    // element of a buffer. Data is the buffer's SymbolId.
+                   // Operands: index
+    Expr_Store,    // assignment to an element of a buffer. Data is the
+                   // buffer's SymbolId. Operands: index, value
 };
 
-// VarExprAST - expression class for var/in
-class VarExprAST : public ExprAST {
-    std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
-    std::unique_ptr<ExprAST> Body;
+// ExprTable - all the expression nodes of the top-level item being parsed,
+// stored as parallel arrays indexed by ExprId instead of as a tree of heap
+// objects. The parser appends nodes bottom up, so a node's operands always
+// come before it. The arrays are cleared, keeping their capacity, once the
+// item has been handled, so steady state parsing doesn't allocate at all.
+class ExprTable {
+    std::vector<ExprKind> Kinds;
+    std::vector<uint32_t> Data;
+    // the operands of node E are Operands[OpBegin[E], OpBegin[E + 1])
+    std::vector<uint32_t> OpBegin{0};
+    std::vector<ExprId> Operands;
+    std::vector<double> Numbers;
+    std::vector<SymbolId> Symbols;
+    // Shared - the pure nodes added with findOrAdd, keyed on kind and data
+    // (or a number's bits) and on their operands
+    DenseMap<std::pair<uint64_t, uint64_t>, ExprId> Shared;
+
 public:
-    VarExprAST(std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames,
-                std::unique_ptr<ExprAST> Body)
-    : VarNames(std::move(VarNames)), Body(std::move(Body)) {}
+    ExprId add(ExprKind K, uint32_t D, ArrayRef<ExprId> Ops = None) {
+        Kinds.push_back(K);
+        Data.push_back(D);
+        Operands.insert(Operands.end(), Ops.begin(), Ops.end());
+        OpBegin.push_back(Operands.size());
+        return Kinds.size() - 1;
+    }
 
-    Value *codegen() override;
-};
+    ExprId addNumber(double Val) {
+        Numbers.push_back(Val);
+        return add(Expr_Number, Numbers.size() - 1);
+    }
+
+    // findOrAdd - add a node that has no side effects and so computes the same
+    // value wherever it appears, unless an identical node already exists.
+    // Operands are compared by id, so whole subtrees are shared when they are
+    // built from shared nodes.
+    ExprId findOrAdd(ExprKind K, uint32_t D, ArrayRef<ExprId> Ops = None) {
+        assert(Ops.size() <= 2 && "pure nodes have at most two operands");
+        uint64_t Op0 = Ops.size() > 0 ? Ops[0] : NoExpr;
+        uint64_t Op1 = Ops.size() > 1 ? Ops[1] : NoExpr;
+        auto R = Shared.insert(std::make_pair(
+            std::make_pair((uint64_t)K << 32 | D, Op0 << 32 | Op1),
+            (ExprId)size()));
+        if (!R.second)
+            return R.first->second;
+        return add(K, D, Ops);
+    }
 
-// BinaryExprAST - Expression class for a binary operator
-class BinaryExprAST : public ExprAST {
-    char Op;
-    std::unique_ptr<ExprAST> LHS, RHS;
+    ExprId findOrAddNumber(double Val) {
+        uint64_t Bits;
+        std::memcpy(&Bits, &Val, sizeof(double));
+        auto R = Shared.insert(std::make_pair(
+            std::make_pair((uint64_t)Expr_Number << 32, Bits),
+            (ExprId)size()));
+        if (!R.second)
+            return R.first->second;
+        return addNumber(Val);
+    }
 
-public:
-    BinaryExprAST(char op, std::unique_ptr<ExprAST> LHS,
-                    std::unique_ptr<ExprAST> RHS)
-        : Op(op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
-    Value *codegen() override;
-};
+    // addSymbols - append the variables of a var/in to the symbol pool and
+    // return the index of the first
+    uint32_t addSymbols(ArrayRef<SymbolId> Syms) {
+        Symbols.insert(Symbols.end(), Syms.begin(), Syms.end());
+        return Symbols.size() - Syms.size();
+    }
 
-// UnaryExprAST - Expression class for a unary operator
-class UnaryExprAST : public ExprAST {
-    char Opcode;
-    std::unique_ptr<ExprAST> Operand;
+    ExprKind kind(ExprId E) const { return Kinds[E]; }
+    char opcode(ExprId E) const { return (char)Data[E]; }
+    double number(ExprId E) const { return Numbers[Data[E]]; }
+    SymbolId symbol(ExprId E) const { return Data[E]; }
+    SymbolId varSymbol(ExprId E, unsigned I) const {
+        return Symbols[Data[E] + I];
+    }
 
-public:
-    UnaryExprAST(char Opcode, std::unique_ptr<ExprAST> Operand)
-    : Opcode(Opcode), Operand(std::move(Operand)) {}
+    ArrayRef<ExprId> operands(ExprId E) const {
+        return makeArrayRef(Operands.data() + OpBegin[E],
+                            Operands.data() + OpBegin[E + 1]);
+    }
+    ExprId operand(ExprId E, unsigned I) const {
+        return Operands[OpBegin[E] + I];
+    }
 
-    Value *codegen() override;
-};
+    // setOperand/makeNumber - rewrite a node in place. A node turned into a
+    // number keeps its old operand range, which nothing reads for numbers.
+    void setOperand(ExprId E, unsigned I, ExprId Op) {
+        Operands[OpBegin[E] + I] = Op;
+    }
+    void makeNumber(ExprId E, double Val) {
+        Kinds[E] = Expr_Number;
+        Data[E] = Numbers.size();
+        Numbers.push_back(Val);
+    }
 
-// IfExprAST - Expression class for if-then-else control flow statements
-class IfExprAST : public ExprAST {
-    std::unique_ptr<ExprAST> Cond, Then, Else;
-public:
-    IfExprAST(std::unique_ptr<ExprAST> Cond, std::unique_ptr<ExprAST> Then,
-              std::unique_ptr<ExprAST> Else)
-    : Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else)) {}
-    Value *codegen() override;
+    size_t size() const { return Kinds.size(); }
+
+    // bytes - memory held by the table, for the peak memory statistic
+    size_t bytes() const {
+        return Kinds.capacity() * sizeof(ExprKind) +
+               (Data.capacity() + OpBegin.capacity()) * sizeof(uint32_t) +
+               Operands.capacity() * sizeof(ExprId) +
+               Numbers.capacity() * sizeof(double) +
+               Symbols.capacity() * sizeof(SymbolId) +
+               Shared.getMemorySize();
+    }
+
+    void clear() {
+        Kinds.clear();
+        Data.clear();
+        OpBegin.resize(1);
+        Operands.clear();
+        Numbers.clear();
+        Symbols.clear();
+        Shared.clear();
+    }
 };
 
-// ForExprAST - Expression class for For loops
-class ForExprAST : public ExprAST {
-    std::string VarName;
-    std::unique_ptr<ExprAST> Init, Cond, Step, Body;
-public:
-    ForExprAST(const std::string &VarName, std::unique_ptr<ExprAST> Init,
-            std::unique_ptr<ExprAST> Cond, std::unique_ptr<ExprAST> Step,
-            std::unique_ptr<ExprAST> Body)
-    : VarName(VarName), Init(std::move(Init)), Cond(std::move(Cond)), Step(std::move(Step)),
-        Body(std::move(Body)) {}
-    Value *codegen() override;
+// PendingOp - an operator that ParseExpression has read but not yet built a
+// node for, because its right operand is still being parsed
+struct PendingOp {
+    int Op;
+    int Prec; // binary precedence, or one of the markers below
 };
 
-// CallExprAST - Expression class for function calls
-class CallExprAST : public ExprAST {
-    std::string Callee;
-    std::vector<std::unique_ptr<ExprAST>> Args;
+static const int UnaryMarker = -1;  // Op is a prefix unary operator
+static const int ParenMarker = -2;  // an open '(' awaiting its ')'
 
-public:
-    CallExprAST(const std::string &Callee,
-                std::vector<std::unique_ptr<ExprAST>> Args)
-        : Callee(Callee), Args(std::move(Args)) {}
-    Value *codegen() override;
+namespace {
+class PrototypeAST;
+class Bytecode;
+class ExprCache;
+} // end anonymous namespace
+class ImportStore;
+class Pipeline;
+
+// CompilerState - everything the compiler works on, options included: one
+// for each CompilerSession, and one for each -jobs worker thread. The
+// compiler's code finds it through State, which the session active on the
+// thread points at its own (see the end of the file), so sessions on
+// different threads never share any.
+struct CompilerState {
+    // Options - the session's, which the -jobs workers copy
+    CompilerOptions Options;
+
+    // TheContext/Builder - what IR is generated with: the session's, or for
+    // the -jobs workers, a context of their own per unit
+    LLVMContext *TheContext = nullptr;
+    IRBuilder<> *Builder = nullptr;
+    std::unique_ptr<Module> TheModule;
+    // WorkerContexts - the contexts of modules the -jobs workers generated
+    // and handed to the JIT, which have to outlive it
+    std::vector<std::unique_ptr<LLVMContext>> WorkerContexts;
+    KaleidoscopeJIT *TheJIT = nullptr;
+    // TheTargetMachine - what code is optimized for: the JIT's, or for the
+    // -jobs workers, their own, since a TargetMachine isn't thread safe
+    TargetMachine *TheTargetMachine = nullptr;
+    // TheFPM - the passes each function of TheModule gets as it is generated,
+    // null when -O or -passes ask for a module pipeline instead
+    std::unique_ptr<FunctionOptimizer> TheFPM;
+
+    // Source - what the lexer reads
+    SourceBuffer *Source = nullptr;
+    // SymbolIds/SymbolNames - the interning table and its inverse. Looking a
+    // name up hashes the lexer's view of it; only the first occurrence
+    // copies it.
+    StringMap<SymbolId> SymbolIds;
+    std::vector<StringRef> SymbolNames = std::vector<StringRef>(1);
+    // OperatorSyms - the symbols getOperatorSymbol has interned, by kind and
+    // operator character
+    SymbolId OperatorSyms[2][256] = {};
+    StringRef IdentifierStr; // filled in if tok_identifier, valid until the next gettok
+    SymbolId IdentifierSym = NoSymbol; // filled in if tok_identifier
+    double NumVal = 0;                 // filled in if tok_number
+
+    // AST - the expression nodes of the item being parsed
+    ExprTable AST;
+    // PeakASTNodes/PeakASTBytes - high water mark of the expression table,
+    // reported by -toy-stats
+    size_t PeakASTNodes = 0, PeakASTBytes = 0;
+    // NumParsedNodes/NumSharedNodes - nodes the parser asked for, and how
+    // many of them were an existing node reused by hash consing, reported by
+    // -toy-stats
+    uint64_t NumParsedNodes = 0, NumSharedNodes = 0;
+
+    int CurTok = 0; // the token the parser is looking at, see getNextToken
+    // NumErrors - errors reported on stderr, so that CompilerSession::compile
+    // can tell whether its input compiled cleanly
+    unsigned NumErrors = 0;
+    // BinopPrecedence - This holds the precedence for each binary
+    // operator that is defined, 0 for characters that aren't binary operators
+    int BinopPrecedence[256] = {};
+    // OpStack/OperandStack - the explicit stacks of ParseExpression. They are
+    // shared by the nested calls that if/for/var/call parse their parts
+    // with; each call only touches the entries above where it found the
+    // stacks. The functions using them look them up once, rather than going
+    // through State each time.
+    std::vector<PendingOp> OpStack;
+    std::vector<ExprId> OperandStack;
+    // NumFolded/NumConstantExprs - counters reported by -toy-stats
+    uint64_t NumFolded = 0, NumConstantExprs = 0;
+
+    // FunctionProtos - the most recent prototype seen for each function,
+    // indexed by the function's SymbolId
+    std::vector<std::unique_ptr<PrototypeAST>> FunctionProtos;
+    // PrototypeVersions - for each function, the value NumPrototypesSet had
+    // when its prototype was last set, so that code compiled against a
+    // function can tell whether it has been redefined since
+    std::vector<uint64_t> PrototypeVersions;
+    uint64_t NumPrototypesSet = 0;
+
+    // NamedValues - the current binding of every symbol in the function being
+    // generated, indexed by SymbolId and null where the symbol isn't a
+    // variable. With -direct-ssa a binding is the variable's current SSA
+    // value, otherwise it is the variable's alloca. A buffer is bound to its
+    // pointer argument either way, as it can't be assigned.
+    // ScopeStack records the bindings that var/for and the function's
+    // arguments shadowed, so leaving a scope just pops back to where it
+    // started.
+    std::vector<Value *> NamedValues;
+    std::vector<std::pair<SymbolId, Value *>> ScopeStack;
+    // CodegenEpoch - advanced whenever a value emitted so far may not be
+    // valid at the insertion point any more: codegen moved to another block,
+    // or a variable was assigned or rebound. CodegenMemo holds the value of
+    // each shared pure node and the epoch it was emitted in, so that
+    // codegenExpr emits a node used several times once, as long as its value
+    // is still valid.
+    uint64_t CodegenEpoch = 0;
+    std::vector<std::pair<Value *, uint64_t>> CodegenMemo;
+    // NumMemoHits - pure nodes whose value codegen reused, for -toy-stats
+    uint64_t NumMemoHits = 0;
+    // NumIRInsts - instructions emitted before any optimization, for
+    // -toy-stats
+    uint64_t NumIRInsts = 0;
+    // UnsealedPhis - loop header phis whose back edge hasn't been emitted
+    // yet. They may look trivial until then, so they must not be removed.
+    SmallPtrSet<PHINode *, 16> UnsealedPhis;
+
+    std::unique_ptr<ImportStore> TheImports;
+    // ObjectDefinitions - the modules of definitions handed to the JIT, in
+    // the order it got them, for output.o
+    std::vector<std::string> ObjectDefinitions;
+    // NumPendingDefinitions - definitions in TheModule that haven't been
+    // handed to the JIT yet
+    unsigned NumPendingDefinitions = 0;
+    // NumPipelinedUnits - units the main thread took from the workers,
+    // reported by -toy-stats
+    unsigned NumPipelinedUnits = 0;
+    std::unique_ptr<Pipeline> ThePipeline;
+
+    // NumInterpretedExprs/NumBytecodeInsts - counters reported by -toy-stats
+    uint64_t NumInterpretedExprs = 0, NumBytecodeInsts = 0;
+    std::unique_ptr<Bytecode> TheBytecode;
+    std::unique_ptr<ExprCache> TheExprCache;
+
+    // defined once the classes held by pointer are
+    CompilerState();
+    ~CompilerState();
 };
 
+// State - the compiler state of the session active on this thread
+static thread_local CompilerState *State;
+
+static SymbolId intern(StringRef Name) {
+    auto R = State->SymbolIds.insert(
+        std::make_pair(Name, (SymbolId)State->SymbolNames.size()));
+    if (R.second)
+        State->SymbolNames.push_back(R.first->getKey());
+    return R.first->second;
+}
+
+static StringRef symbolName(SymbolId Sym) { return State->SymbolNames[Sym]; }
+
+// getOperatorSymbol - the symbol of the function implementing a user defined
+// unary or binary operator, e.g. "binary|", interned on first use
+static SymbolId getOperatorSymbol(bool IsBinary, char Op) {
+    SymbolId &Sym = State->OperatorSyms[IsBinary][(unsigned char)Op];
+    if (Sym == NoSymbol)
+        Sym = intern((IsBinary ? "binary" : "unary") + std::string(1, Op));
+    return Sym;
+}
+
+// CharClass - one table load per byte in the lexer's hot loops instead of a
+// chain of <cctype> calls (which also go through the locale)
+enum : uint8_t { CC_Space = 1, CC_Alpha = 2, CC_Digit = 4, CC_Dot = 8 };
+
+static const struct CharClassTable {
+    uint8_t Class[256] = {};
+
+    CharClassTable() {
+        for (unsigned char C : {' ', '\t', '\n', '\v', '\f', '\r'})
+            Class[C] = CC_Space;
+        for (unsigned C = 'a'; C <= 'z'; ++C)
+            Class[C] = Class[C - 'a' + 'A'] = CC_Alpha;
+        for (unsigned C = '0'; C <= '9'; ++C)
+            Class[C] = CC_Digit;
+        Class[(unsigned char)'.'] = CC_Dot;
+    }
+
+    bool is(char C, uint8_t Mask) const { return Class[(unsigned char)C] & Mask; }
+} CharClass;
+
+// getKeywordToken - map an identifier to its keyword token, or tok_identifier.
+// Switching on the length first means most identifiers are rejected after at
+// most three short compares.
+static int getKeywordToken(StringRef Id) {
+    switch (Id.size()) {
+    case 2:
+        if (Id == "if") return tok_if;
+        if (Id == "in") return tok_in;
+        break;
+    case 3:
+        if (Id == "def") return tok_def;
+        if (Id == "for") return tok_for;
+        if (Id == "var") return tok_var;
+        break;
+    case 4:
+        if (Id == "then") return tok_then;
+        if (Id == "else") return tok_else;
+        break;
+    case 5:
+        if (Id == "unary") return tok_unary;
+        break;
+    case 6:
+        if (Id == "extern") return tok_extern;
+        if (Id == "binary") return tok_binary;
+        break;
+    }
+    return tok_identifier;
+}
+
+// parseNumber - convert the text of a number token, [0-9.]+, to a double
+// without copying it. As with strtod, everything from a second '.' on is
+// ignored. A mantissa of at most 53 bits and a power of ten up to 1e22 are
+// both exact doubles, so one IEEE divide gives the correctly rounded result
+// (Clinger's fast path); anything longer falls back to strtod.
+static double parseNumber(const char *Start, const char *End) {
+    static const double Pow10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                   1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                   1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+                                   1e18, 1e19, 1e20, 1e21, 1e22};
+    uint64_t Mantissa = 0;
+    unsigned Digits = 0;
+    int Exp = 0;
+    bool SeenDot = false;
+
+    for (const char *P = Start; P != End; ++P) {
+        if (*P == '.') {
+            if (SeenDot)
+                break;
+            SeenDot = true;
+            continue;
+        }
+
+        unsigned D = *P - '0';
+        if (Mantissa || D) {
+            // past 19 digits the mantissa could overflow 64 bits
+            if (++Digits > 19)
+                break;
+            Mantissa = Mantissa * 10 + D;
+        }
+        if (SeenDot)
+            --Exp;
+    }
+
+    if (Digits <= 19 && Mantissa <= (uint64_t(1) << 53) && -Exp <= 22)
+        return (double)Mantissa / Pow10[-Exp];
+
+    SmallString<64> NumStr(Start, End);
+    return strtod(NumStr.c_str(), nullptr);
+}
+
+static int gettok() {
+    // look the source up once, rather than through State for every byte
+    SourceBuffer &Src = *State->Source;
+    const char *&CurPtr = Src.CurPtr;
+
+    // skip any whitespace, pulling in more input when the buffer runs dry
+    while (true) {
+        while (CharClass.is(*CurPtr, CC_Space))
+            ++CurPtr;
+        if (CurPtr != Src.BufEnd)
+            break;
+        if (!Src.refill()) {
+            Src.TokStart = CurPtr;
+            return tok_eof;
+        }
+    }
+    Src.TokStart = CurPtr;
+
+    if (CharClass.is(*CurPtr, CC_Alpha)){ // identifier: [a-zA-Z][a-zA-Z0-9]*
+        const char *Start = CurPtr;
+        while (CharClass.is(*++CurPtr, CC_Alpha | CC_Digit))
+            ;
+        State->IdentifierStr = StringRef(Start, CurPtr - Start);
+        int Tok = getKeywordToken(State->IdentifierStr);
+        if (Tok == tok_identifier)
+            State->IdentifierSym = intern(State->IdentifierStr);
+        return Tok;
+    }
+
+    if (CharClass.is(*CurPtr, CC_Digit | CC_Dot)){  // Number: [0-9.]+
+        const char *Start = CurPtr;
+        while (CharClass.is(*++CurPtr, CC_Digit | CC_Dot))
+            ;
+        State->NumVal = parseNumber(Start, CurPtr);
+        return tok_number;
+    }
+
+    if (*CurPtr == '#'){
+        // comment until end of line
+        do
+            ++CurPtr;
+        while (CurPtr != Src.BufEnd && *CurPtr != '\n' && *CurPtr != '\r');
+
+        return gettok();
+    }
+
+    return (unsigned char)*CurPtr++;
+}
+
+// ResetAST - drop the expression nodes of the item just handled
+static void ResetAST() {
+    ExprTable &AST = State->AST;
+    State->PeakASTNodes = std::max(State->PeakASTNodes, AST.size());
+    State->PeakASTBytes = std::max(State->PeakASTBytes, AST.bytes());
+    AST.clear();
+}
+
+namespace {
 // PrototypeAST - represents the prototype for a function,
 // which captures its name and arguments (implicitly then,
 // its number of arguments as well.)
 class PrototypeAST {
-    std::string Name;
-    std::vector<std::string> Args;
+    SymbolId Name;
+    std::vector<SymbolId> Args;
+    std::vector<bool> Buffers; // which of Args are buffers, empty if none
     bool IsOperator;
     unsigned Precedence; // precedence if a binary op
 
 public:
-    PrototypeAST(const std::string &Name, std::vector<std::string> Args,
-                bool IsOperator = false, unsigned Prec = 0)
-        : Name(Name), Args(std::move(Args)), IsOperator(IsOperator), Precedence(Prec) {}
-    const std::string &getName() const { return Name; }
+    PrototypeAST(SymbolId Name, std::vector<SymbolId> Args,
+                bool IsOperator = false, unsigned Prec = 0,
+                std::vector<bool> Buffers = {})
+        : Name(Name), Args(std::move(Args)), Buffers(std::move(Buffers)),
+          IsOperator(IsOperator), Precedence(Prec) {}
+    SymbolId getSymbol() const { return Name; }
+    StringRef getName() const { return symbolName(Name); }
+    ArrayRef<SymbolId> getArgs() const { return Args; }
+    const std::vector<bool> &getBuffers() const { return Buffers; }
+    bool isBuffer(unsigned I) const { return I < Buffers.size() && Buffers[I]; }
+    bool hasBuffers() const { return is_contained(Buffers, true); }
     Function *codegen();
 
     bool isUnaryOp() const { return IsOperator && Args.size() == 1; }
@@ -269,22 +991,30 @@ public:
 
     char getOperatorName() const {
         assert(isUnaryOp() || isBinaryOp());
-        return Name[Name.size() - 1];
+        return getName().back();
     }
 
     unsigned getBinaryPrecedence() const { return Precedence; }
 };
 
-// FunctionAST - represents a function definition itself
+// FunctionAST - represents a function definition itself. The prototype
+// outlives the item (it moves to FunctionProtos), the body is in the
+// expression table.
 class FunctionAST {
     std::unique_ptr<PrototypeAST> Proto;
-    std::unique_ptr<ExprAST> Body;
+    ExprId Body;
+    Optional<FastMathFlags> MathFlags; // if the definition lists its own
 
 public:
-    FunctionAST(std::unique_ptr<PrototypeAST> Proto,
-                std::unique_ptr<ExprAST> Body)
-        : Proto(std::move(Proto)), Body(std::move(Body)) {}
-    Function *codegen();
+    FunctionAST(std::unique_ptr<PrototypeAST> Proto, ExprId Body,
+                Optional<FastMathFlags> MathFlags = None)
+        : Proto(std::move(Proto)), Body(Body), MathFlags(MathFlags) {}
+    void simplify();
+    bool isConstant() const { return State->AST.kind(Body) == Expr_Number; }
+    double getConstant() const { return State->AST.number(Body); }
+    ExprId getBody() const { return Body; }
+    StringRef getName() const { return Proto->getName(); }
+    Function *codegen(bool Optimize = true);
 };
 
 } // end anonymous namespace
@@ -292,15 +1022,64 @@ public:
 // CurTok/getNextToken - provides a simple token buffer. CurTok is
 // the current token the parser is looking at. getNextToken reads
 // another token from the lexer and updates CurTok with its results.
-static int CurTok;
 static int getNextToken() {
-    return CurTok = gettok();
+    return State->CurTok = gettok();
+}
+
+// Diagnostics - where this thread reports errors and the definitions it
+// read, stderr unless set. The -jobs workers collect theirs to be printed in
+// order by the thread running MainLoop.
+static thread_local raw_ostream *Diagnostics = nullptr;
+
+static raw_ostream &diags() { return Diagnostics ? *Diagnostics : errs(); }
+
+// LoopRemarkHandler - prints the remarks of the loop vectorizer and unroller
+// with -loop-remarks, naming the function, since the IR carries no source
+// locations, and drops any other pass's
+struct LoopRemarkHandler : public DiagnosticHandler {
+    static bool isLoopPass(StringRef PassName) {
+        return PassName == "loop-vectorize" || PassName == "loop-unroll";
+    }
+
+    bool handleDiagnostics(const DiagnosticInfo &DI) override {
+        auto *Remark = dyn_cast<DiagnosticInfoOptimizationBase>(&DI);
+        if (!Remark)
+            return false;
+        if (isLoopPass(Remark->getPassName()))
+            diags() << "remark: " << Remark->getFunction().getName() << ": "
+                    << Remark->getPassName() << ": " << Remark->getMsg()
+                    << "\n";
+        return true;
+    }
+
+    bool isAnalysisRemarkEnabled(StringRef PassName) const override {
+        return isLoopPass(PassName);
+    }
+    bool isMissedOptRemarkEnabled(StringRef PassName) const override {
+        return isLoopPass(PassName);
+    }
+    bool isPassedOptRemarkEnabled(StringRef PassName) const override {
+        return isLoopPass(PassName);
+    }
+    bool isAnyRemarkEnabled() const override { return true; }
+};
+
+// setUpContext - prepare a context the compiler generates IR in
+static void setUpContext(LLVMContext &Context,
+                         const CompilerOptions &Options) {
+    if (Options.LoopRemarks)
+        Context.setDiagnosticHandler(llvm::make_unique<LoopRemarkHandler>());
 }
 
 // LogError* - helper functions for error handling
-std::unique_ptr<ExprAST> LogError(const char *Str) {
-    fprintf(stderr, "LogError: %s\n", Str);
-    return nullptr;
+ExprId LogError(const char *Str) {
+    if (Diagnostics) {
+        *Diagnostics << "LogError: " << Str << "\n";
+    } else {
+        fprintf(stderr, "LogError: %s\n", Str);
+        ++State->NumErrors;
+    }
+    return NoExpr;
 }
 std::unique_ptr<PrototypeAST> LogErrorP(const char *Str){
     LogError(Str);
@@ -312,193 +1091,213 @@ Value *LogErrorV(const char *Str){
     return nullptr;
 }
 
-// numberexpr ::= number
-static std::unique_ptr<ExprAST> ParseNumberExpr() {
-    auto Result = llvm::make_unique<NumberExprAST>(NumVal);
-    getNextToken(); // consume the numer
-    return std::move(Result);
+// addPureExpr/addNumberExpr - add a node without side effects. With
+// -hash-cons identical ones are shared, so codegen emits them once.
+static ExprId addPureExpr(ExprKind K, uint32_t D, ArrayRef<ExprId> Ops = None) {
+    ExprTable &Table = State->AST; // look it up once
+    ++State->NumParsedNodes;
+    if (!State->Options.HashCons)
+        return Table.add(K, D, Ops);
+    size_t OldSize = Table.size();
+    ExprId E = Table.findOrAdd(K, D, Ops);
+    State->NumSharedNodes += Table.size() == OldSize;
+    return E;
 }
 
-static std::unique_ptr<ExprAST> ParseExpression();
-static std::unique_ptr<ExprAST> ParsePrimary();
+static ExprId addNumberExpr(double Val) {
+    ExprTable &Table = State->AST; // look it up once
+    ++State->NumParsedNodes;
+    if (!State->Options.HashCons)
+        return Table.addNumber(Val);
+    size_t OldSize = Table.size();
+    ExprId E = Table.findOrAddNumber(Val);
+    State->NumSharedNodes += Table.size() == OldSize;
+    return E;
+}
 
-// unary
-//      ::= primary
-//      ::= '!' unary
-static std::unique_ptr<ExprAST> ParseUnary() {
-    // if the current token is not an operator, it must be a primary expr
-    if (!isascii(CurTok) || CurTok == '(' || CurTok == ',')
-        return ParsePrimary();
-
-    // if this is a unary operator, read it
-    int Opc = CurTok;
-    getNextToken();
-    if (auto Operand = ParseUnary())
-        return llvm::make_unique<UnaryExprAST>(Opc, std::move(Operand));
-    return nullptr;
+// isPureBinop - whether binary operator Op is free of side effects. The
+// builtin arithmetic and comparison are; assignment and user defined
+// operators, which are function calls, aren't.
+static bool isPureBinop(int Op) {
+    return Op == '+' || Op == '-' || Op == '*' || Op == '<';
+}
+
+// addExpr - add any other node
+static ExprId addExpr(ExprKind K, uint32_t D, ArrayRef<ExprId> Ops = None) {
+    ++State->NumParsedNodes;
+    return State->AST.add(K, D, Ops);
+}
+
+// numberexpr ::= number
+static ExprId ParseNumberExpr() {
+    auto Result = addNumberExpr(State->NumVal);
+    getNextToken(); // consume the numer
+    return Result;
 }
 
-static std::unique_ptr<ExprAST> ParseIfExpr() {
+static ExprId ParseExpression();
+
+static ExprId ParseIfExpr() {
     getNextToken();
     auto Cond = ParseExpression();
-    if (!Cond)
-        return nullptr;
+    if (Cond == NoExpr)
+        return NoExpr;
 
-    if (CurTok != tok_then)
+    if (State->CurTok != tok_then)
         return LogError("expected then");
     getNextToken();
 
     auto Then = ParseExpression();
-    if (!Then)
-        return nullptr;
+    if (Then == NoExpr)
+        return NoExpr;
 
-    if (CurTok != tok_else)
+    if (State->CurTok != tok_else)
         return LogError("expected else");
     getNextToken();
 
     auto Else = ParseExpression();
-    if (!Else)
-        return nullptr;
+    if (Else == NoExpr)
+        return NoExpr;
 
-    return llvm::make_unique<IfExprAST>(std::move(Cond), std::move(Then),
-                                        std::move(Else));
+    return addExpr(Expr_If, 0, {Cond, Then, Else});
 }
 
 // forexpr ::= 'for' identifier '=' expr ',' expr (',' expr)? 'in' expression
-static std::unique_ptr<ExprAST> ParseForExpr(){
+static ExprId ParseForExpr(){
     getNextToken(); // eat the for
 
-    if (CurTok != tok_identifier)
+    if (State->CurTok != tok_identifier)
         return LogError("expected identifier after for");
 
-    std::string IdName = IdentifierStr;
+    SymbolId IdName = State->IdentifierSym;
     getNextToken(); // eat identifier
 
-    if (CurTok != '=')
+    if (State->CurTok != '=')
         return LogError("expected '=' after for");
     getNextToken(); // eat '='
 
     auto Init = ParseExpression();
-    if (!Init)
-        return nullptr;
-    if (CurTok != ',')
+    if (Init == NoExpr)
+        return NoExpr;
+    if (State->CurTok != ',')
         return LogError("expected ',' after for start value");
     getNextToken();
 
     auto Cond = ParseExpression();
-    if (!Cond)
-        return nullptr;
+    if (Cond == NoExpr)
+        return NoExpr;
 
     // the step value is optional
-    std::unique_ptr<ExprAST> Step;
-    if (CurTok == ',') {
+    ExprId Step = NoExpr;
+    if (State->CurTok == ',') {
         getNextToken();
         Step = ParseExpression();
-        if (!Step)
-            return nullptr;
+        if (Step == NoExpr)
+            return NoExpr;
     }
 
-    if (CurTok != tok_in)
+    if (State->CurTok != tok_in)
         return LogError("expected 'in' after for");
     getNextToken(); // eat the 'in'.
 
     auto Body = ParseExpression();
-    if (!Body)
-        return nullptr;
-
-    return llvm::make_unique<ForExprAST>(IdName, std::move(Init),
-                                        std::move(Cond), std::move(Step),
-                                        std::move(Body));
+    if (Body == NoExpr)
+        return NoExpr;
 
+    return addExpr(Expr_For, IdName, {Init, Cond, Step, Body});
 }
 
 // varexpr ::= 'var' identifier ('=' expression)?
 //                  (',' identifier ('=' expression)?)* 'in' expression
-static std::unique_ptr<ExprAST> ParseVarExpr(){
+static ExprId ParseVarExpr(){
     getNextToken(); // eat the var
 
-    std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
+    // the names go into the symbol pool together once the initializers,
+    // which may be var/in expressions themselves, have been parsed
+    SmallVector<SymbolId, 4> VarNames;
+    SmallVector<ExprId, 5> Operands;
 
     // at least one variable name is required
-    if (CurTok != tok_identifier)
+    if (State->CurTok != tok_identifier)
         return LogError("expected identifier after var");
 
     while (1) {
-        std::string Name = IdentifierStr;
+        VarNames.push_back(State->IdentifierSym);
         getNextToken(); // eat identifier
 
         // read the optional initializer
-        std::unique_ptr<ExprAST> Init;
-        if (CurTok == '='){
+        ExprId Init = NoExpr;
+        if (State->CurTok == '='){
             getNextToken(); // eat the '='.
 
             Init = ParseExpression();
-            if (!Init)
-                return nullptr;
+            if (Init == NoExpr)
+                return NoExpr;
         }
 
-        VarNames.push_back(std::make_pair(Name, std::move(Init)));
+        Operands.push_back(Init);
 
         // end of var list, exit loop
-        if (CurTok != ',')
+        if (State->CurTok != ',')
             break;
         getNextToken(); // eat the ','
 
-        if (CurTok != tok_identifier)
+        if (State->CurTok != tok_identifier)
             return LogError("expected identifier list after var");
 
     }
     // at this point, we have the 'in'
-    if (CurTok != tok_in)
+    if (State->CurTok != tok_in)
         return LogError("Expected 'in' keyword after 'var'");
     getNextToken(); // eat in
 
     auto Body = ParseExpression();
-    if (!Body)
-        return nullptr;
+    if (Body == NoExpr)
+        return NoExpr;
 
-    return llvm::make_unique<VarExprAST>(std::move(VarNames), std::move(Body));
+    Operands.push_back(Body);
+    return addExpr(Expr_Var, State->AST.addSymbols(VarNames), Operands);
 }
 
 
-// parenexpr ::= '(' expression ')'
-static std::unique_ptr<ExprAST> ParseParenExpr() {
-    getNextToken(); // eat (.
-    auto V = ParseExpression();
-    if (!V)
-        return nullptr;
-
-    if (CurTok != ')')
-        return LogError("expected ')'");
-    getNextToken(); // eat ).
-    return V;
-}
-
 // identifierexpr
 //  ::= identifier
+//  ::= identifier '[' expression ']'
 //  ::= identifier '(' expression* ')'
-static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
-    std::string IdName = IdentifierStr;
+static ExprId ParseIdentifierExpr() {
+    SymbolId IdName = State->IdentifierSym;
 
     getNextToken(); // eat identifier
 
-    if (CurTok != '(') // simple variable ref
-        return llvm::make_unique<VariableExprAST>(IdName);
+    // element of a buffer. Loads aren't pure, as stores can come in between.
+    if (State->CurTok == '[') {
+        getNextToken(); // eat [
+        auto Index = ParseExpression();
+        if (Index == NoExpr)
+            return NoExpr;
+        if (State->CurTok != ']')
+            return LogError("Expected ']' after index");
+        getNextToken(); // eat ]
+        return addExpr(Expr_Index, IdName, Index);
+    }
+
+    if (State->CurTok != '(') // simple variable ref
+        return addPureExpr(Expr_Variable, IdName);
 
     // Call
     getNextToken(); // eat (
-    std::vector<std::unique_ptr<ExprAST>> Args;
-    if (CurTok != ')'){
+    SmallVector<ExprId, 8> Args;
+    if (State->CurTok != ')'){
         while (true){
-            if (auto Arg = ParseExpression())
-                Args.push_back(std::move(Arg));
-            else
-                return nullptr;
+            auto Arg = ParseExpression();
+            if (Arg == NoExpr)
+                return NoExpr;
+            Args.push_back(Arg);
 
-            if (CurTok == ')')
+            if (State->CurTok == ')')
                 break;
 
-            if (CurTok != ',')
+            if (State->CurTok != ',')
                 return LogError("Exprected ')' or ',' in argument list");
             getNextToken();
         }
@@ -507,23 +1306,24 @@ static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
     // eat the ')'
     getNextToken();
 
-    return llvm::make_unique<CallExprAST>(IdName, std::move(Args));
+    return addExpr(Expr_Call, IdName, Args);
 }
 
 // primary
 //  ::= identifierexpr
 //  ::= numberexpr
-//  ::= parenexpr
-static std::unique_ptr<ExprAST> ParsePrimary() {
-    switch (CurTok){
+//  ::= ifexpr
+//  ::= forexpr
+//  ::= varexpr
+// parenthesized expressions are handled by ParseExpression itself
+static ExprId ParsePrimary() {
+    switch (State->CurTok){
     default:
         return LogError("unknown token when expecting an expression");
     case tok_identifier:
         return ParseIdentifierExpr();
     case tok_number:
         return ParseNumberExpr();
-    case '(':
-        return ParseParenExpr();
     case tok_if:
         return ParseIfExpr();
     case tok_for:
@@ -534,119 +1334,181 @@ static std::unique_ptr<ExprAST> ParsePrimary() {
 
 }
 
-// BinopPrecedence - This holds the precedence for each binary
-// operator that is defined
-static std::map<char, int> BinopPrecedence;
-
 // GetTokPrecedence - get the precedence of the pending binary opaerator token
 static int GetTokPrecedence(){
-    if (!isascii(CurTok)){
+    if (!isascii(State->CurTok)){
         return -1;
     }
 
     // make sure its a declared binop
-    auto TokPrec = BinopPrecedence[CurTok];
+    auto TokPrec = State->BinopPrecedence[State->CurTok];
     if (TokPrec <= 0) return -1;
     return TokPrec;
 }
 
-// binopsrhs
-//  := ('+' unary)*
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
-                                               std::unique_ptr<ExprAST> LHS){
-    // if this is a binop, find its precedence
-    while (true){
-        auto TokPrec = GetTokPrecedence();
-
-        // if this is a binop that binds at least as tightly as
-        // the current binop, consume it, otherwise we are done
-        if (TokPrec < ExprPrec)
-            return LHS;
+// reduceUnary - apply the prefix operators pending directly above the operand
+// on top of the operand stack. They bind tighter than any binary operator.
+static void reduceUnary(size_t OpBase) {
+    auto &Pending = State->OpStack;
+    auto &Operands = State->OperandStack;
+    while (Pending.size() > OpBase && Pending.back().Prec == UnaryMarker) {
+        ExprId Operand = Operands.back();
+        Operands.back() = addExpr(Expr_Unary, Pending.back().Op, Operand);
+        Pending.pop_back();
+    }
+}
 
-        auto BinOp = CurTok;
-        getNextToken(); // eat binop
+// reduceBinary - build nodes for the pending binary operators that bind at
+// least as tightly as MinPrec, stopping at the innermost open '('
+static void reduceBinary(size_t OpBase, int MinPrec) {
+    ExprTable &AST = State->AST;
+    auto &Pending = State->OpStack;
+    auto &Operands = State->OperandStack;
+    while (Pending.size() > OpBase && Pending.back().Prec >= MinPrec) {
+        ExprId RHS = Operands.back();
+        Operands.pop_back();
+        ExprId LHS = Operands.back();
+        int Op = Pending.back().Op;
+        if (Op == '=' && AST.kind(LHS) == Expr_Index)
+            Operands.back() = addExpr(Expr_Store, AST.symbol(LHS),
+                                      {AST.operand(LHS, 0), RHS});
+        else
+            Operands.back() = isPureBinop(Op)
+                                  ? addPureExpr(Expr_Binary, Op, {LHS, RHS})
+                                  : addExpr(Expr_Binary, Op, {LHS, RHS});
+        Pending.pop_back();
+    }
+}
 
-        // Parse the primary expression after the binary operator
-        auto RHS = ParseUnary();
-        if(!RHS)
-            return nullptr;
+// expression
+//  ::= unary (binop unary)*
+// unary
+//  ::= primary
+//  ::= '(' expression ')'
+//  ::= '!' unary
+//
+// Operator precedence parsing with explicit operator and operand stacks, so
+// that neither long operator chains nor deeply nested parentheses and prefix
+// operators use any native stack. Binary operators of equal precedence
+// associate to the left, and precedences come from BinopPrecedence, which
+// includes the user defined operators.
+static ExprId ParseExpression() {
+    auto &Pending = State->OpStack;
+    auto &Operands = State->OperandStack;
+    const size_t OpBase = Pending.size(), OperandBase = Operands.size();
+    auto Fail = [&]() {
+        Pending.resize(OpBase);
+        Operands.resize(OperandBase);
+        return NoExpr;
+    };
+
+    while (true) {
+        // read the prefix operators and open parentheses in front of the
+        // next operand. Any other ascii character is a unary operator.
+        while (isascii(State->CurTok) && State->CurTok != ',') {
+            Pending.push_back({State->CurTok, State->CurTok == '(' ? ParenMarker : UnaryMarker});
+            getNextToken();
+        }
 
-        // if BinOp binds less tightly with RHS than the operator after RHS,
-        // let the pending operator take RHS as its LHS
-        auto NextPrec = GetTokPrecedence();
-        if (TokPrec < NextPrec) {
-            RHS = ParseBinOpRHS(TokPrec+1, std::move(RHS));
-            if (!RHS)
-                return nullptr;
+        auto Operand = ParsePrimary();
+        if (Operand == NoExpr)
+            return Fail();
+        Operands.push_back(Operand);
+        reduceUnary(OpBase);
+
+        // close any parentheses that follow the operand. The parenthesized
+        // expression is itself the operand of the prefix operators before it.
+        int TokPrec;
+        while ((TokPrec = GetTokPrecedence()) < 0 && State->CurTok == ')') {
+            reduceBinary(OpBase, 0);
+            if (Pending.size() == OpBase)
+                break; // not ours, leave it to the caller
+            Pending.pop_back();
+            getNextToken(); // eat )
+            reduceUnary(OpBase);
         }
 
-        // Merge LHS/RHS
-        LHS = llvm::make_unique<BinaryExprAST>(BinOp, std::move(LHS),
-                                                        std::move(RHS));
+        if (TokPrec < 0)
+            break;
+
+        // build the pending operators that bind at least as tightly as this
+        // one, which makes equal precedences left associative
+        reduceBinary(OpBase, TokPrec);
+        Pending.push_back({State->CurTok, TokPrec});
+        getNextToken(); // eat binop
     }
-}
 
-static std::unique_ptr<ExprAST> ParseExpression() {
-    auto LHS = ParseUnary();
-    if (!LHS)
-        return nullptr;
+    reduceBinary(OpBase, 0);
+    if (Pending.size() != OpBase) {
+        LogError("expected ')'");
+        return Fail();
+    }
 
-    return ParseBinOpRHS(0, std::move(LHS));
+    auto Result = Operands.back();
+    Operands.pop_back();
+    return Result;
 }
 
 // prototype
-//  ::= id '(' id* ')'
+//  ::= id '(' (id | id '[' ']')* ')'
 //  ::= binary LETTER number? (id, id)
 static std::unique_ptr<PrototypeAST> ParsePrototype() {
-    std::string FnName;
+    SymbolId FnName;
 
     unsigned Kind = 0; // 0 = identifier, 1 = unary, 2 = binary
     unsigned BinaryPrecedence = 30;
 
-    switch (CurTok){
+    switch (State->CurTok){
     default:
         return LogErrorP("Expected function name in prototype");
     case tok_identifier:
-        FnName = IdentifierStr;
+        FnName = State->IdentifierSym;
         Kind = 0;
         getNextToken();
         break;
     case tok_unary:
         getNextToken();
-        if (!isascii(CurTok))
+        if (!isascii(State->CurTok))
             return LogErrorP("Expected unary operator");
-        FnName = "unary";
-        FnName += (char)CurTok;
+        FnName = getOperatorSymbol(false, State->CurTok);
         Kind = 1;
         getNextToken();
         break;
     case tok_binary:
         getNextToken();
-        if (!isascii(CurTok))
+        if (!isascii(State->CurTok))
             return LogErrorP("Expected binary operator");
-        FnName = "binary";
-        FnName += (char)CurTok;
+        FnName = getOperatorSymbol(true, State->CurTok);
         Kind = 2;
         getNextToken();
 
         // read the precedence if present
-        if (CurTok == tok_number){
-            if (NumVal < 1 || NumVal > 100)
+        if (State->CurTok == tok_number){
+            if (State->NumVal < 1 || State->NumVal > 100)
                 return LogErrorP("invalid precedence: must be 1..100");
-            BinaryPrecedence = (unsigned)NumVal;
+            BinaryPrecedence = (unsigned)State->NumVal;
             getNextToken();
         }
         break;
     }
 
-    if (CurTok != '(')
+    if (State->CurTok != '(')
         return LogErrorP("Expected '(' in prototype");
 
-    // read the list of argument names
-    std::vector<std::string> ArgNames;
-    while (getNextToken() == tok_identifier)
-        ArgNames.push_back(IdentifierStr);
-    if (CurTok != ')')
+    // read the list of argument names, a buffer's followed by []
+    std::vector<SymbolId> ArgNames;
+    std::vector<bool> Buffers;
+    getNextToken(); // eat '('
+    while (State->CurTok == tok_identifier) {
+        ArgNames.push_back(State->IdentifierSym);
+        Buffers.push_back(getNextToken() == '[');
+        if (Buffers.back()) {
+            if (getNextToken() != ']')
+                return LogErrorP("Expected ']' after '[' in prototype");
+            getNextToken(); // eat ']'
+        }
+    }
+    if (State->CurTok != ')')
         return LogErrorP("Expected ')' in prototype");
 
     // success
@@ -655,20 +1517,95 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
     // verify right number of names for operator
     if (Kind && ArgNames.size() != Kind)
         return LogErrorP("Invalid number of operands for operator");
+    if (Kind && is_contained(Buffers, true))
+        return LogErrorP("Operators can't take buffers");
+    if (!is_contained(Buffers, true))
+        Buffers.clear();
 
     return llvm::make_unique<PrototypeAST>(FnName, std::move(ArgNames), Kind != 0,
-                                            BinaryPrecedence);
+                                            BinaryPrecedence, std::move(Buffers));
+}
+
+// setMathFlag - add the fast-math flag Name, as LLVM's IR spells it, to
+// FMF, or return false if there is no such flag
+static bool setMathFlag(StringRef Name, FastMathFlags &FMF) {
+    if (Name == "fast")
+        FMF.setFast();
+    else if (Name == "reassoc")
+        FMF.setAllowReassoc();
+    else if (Name == "nnan")
+        FMF.setNoNaNs();
+    else if (Name == "ninf")
+        FMF.setNoInfs();
+    else if (Name == "nsz")
+        FMF.setNoSignedZeros();
+    else if (Name == "arcp")
+        FMF.setAllowReciprocal();
+    else if (Name == "contract")
+        FMF.setAllowContract(true);
+    else if (Name == "afn")
+        FMF.setApproxFunc();
+    else
+        return false;
+    return true;
+}
+
+// sessionMathFlags - the session's -fast-math flags, which a function is
+// built with unless its definition lists its own. They are read from the
+// session's options each time, as sessions may differ; the list is short
+// next to generating the function.
+static FastMathFlags sessionMathFlags() {
+    FastMathFlags FMF;
+    SmallVector<StringRef, 8> Names;
+    StringRef(State->Options.FastMath).split(Names, ',', -1, false);
+    for (StringRef Name : Names)
+        setMathFlag(Name.trim(), FMF);
+    return FMF;
+}
+
+// checkMathOptions - report an unknown -fast-math flag
+static bool checkMathOptions(const CompilerOptions &Options) {
+    SmallVector<StringRef, 8> Names;
+    StringRef(Options.FastMath).split(Names, ',', -1, false);
+    for (StringRef Name : Names) {
+        FastMathFlags FMF;
+        if (!setMathFlag(Name.trim(), FMF)) {
+            errs() << "Unknown fast-math flag '" << Name.trim() << "'\n";
+            return false;
+        }
+    }
+    return true;
 }
 
-// definition ::= 'def' prototype expression
+// definition ::= 'def' prototype ('[' identifier* ']')? expression
+// The identifiers in brackets are the fast-math flags of the function's
+// arithmetic, replacing -fast-math's; [] builds it without any.
 static std::unique_ptr<FunctionAST> ParseDefinition(){
+    TimeRegion T(phaseTimer(ParseTimer));
     getNextToken(); // eat def
     auto Proto = ParsePrototype();
     if (!Proto) return nullptr;
 
-    if (auto E = ParseExpression())
-        return llvm::make_unique<FunctionAST>(std::move(Proto), std::move(E));
-    return nullptr;
+    Optional<FastMathFlags> MathFlags;
+    if (State->CurTok == '[') {
+        FastMathFlags FMF;
+        while (getNextToken() == tok_identifier)
+            if (!setMathFlag(State->IdentifierStr, FMF)) {
+                LogError("Unknown fast-math flag");
+                return nullptr;
+            }
+        if (State->CurTok != ']') {
+            LogError("Expected ']' after fast-math flags");
+            return nullptr;
+        }
+        getNextToken(); // eat ]
+        MathFlags = FMF;
+    }
+
+    auto E = ParseExpression();
+    if (E == NoExpr)
+        return nullptr;
+    return llvm::make_unique<FunctionAST>(std::move(Proto), E, MathFlags);
 }
 
 // external ::= 'extern' prototype
@@ -679,112 +1616,315 @@ static std::unique_ptr<PrototypeAST> ParseExtern(){
 
 // toplevelexpr ::= expression
 static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
-    if (auto E = ParseExpression()){
-        // make an anonymous proto
-        auto Proto = llvm::make_unique<PrototypeAST>("main", std::vector<std::string>());
-        return llvm::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+    TimeRegion T(phaseTimer(ParseTimer));
+    auto E = ParseExpression();
+    if (E == NoExpr)
+        return nullptr;
+
+    // make an anonymous proto
+    auto Proto = llvm::make_unique<PrototypeAST>(intern("__anon_expr"), std::vector<SymbolId>());
+    return llvm::make_unique<FunctionAST>(std::move(Proto), E);
+}
+
+//===----------------------------------------------------------------------===//
+// Simplification
+//===----------------------------------------------------------------------===//
+
+// isNumber - whether E is the constant Val. Compares bits, so that 0.0 and
+// -0.0 are told apart.
+static bool isNumber(ExprId E, double Val) {
+    if (State->AST.kind(E) != Expr_Number)
+        return false;
+    double N = State->AST.number(E);
+    return std::memcmp(&N, &Val, sizeof(double)) == 0;
+}
+
+// simplifyNode - fold E, whose operands have already been simplified. Returns
+// E, rewritten in place to a number if it was constant, or the operand it
+// reduces to.
+//
+// Only rewrites that give the same result as the IR for every input are done,
+// as the IR does without fast-math flags:
+// x*1, 1*x, x-0, x+(-0) and (-0)+x reduce to x, but x+0 doesn't (it turns -0
+// into +0) and neither does x*0 (NaN, infinities and the sign of zero).
+static ExprId simplifyNode(ExprId E) {
+    ExprTable &AST = State->AST;
+    switch (AST.kind(E)) {
+    case Expr_Binary: {
+        ExprId LHS = AST.operand(E, 0), RHS = AST.operand(E, 1);
+        if (AST.kind(LHS) == Expr_Number && AST.kind(RHS) == Expr_Number) {
+            double L = AST.number(LHS), R = AST.number(RHS);
+            switch (AST.opcode(E)) {
+            case '+':
+                AST.makeNumber(E, L + R);
+                return E;
+            case '-':
+                AST.makeNumber(E, L - R);
+                return E;
+            case '*':
+                AST.makeNumber(E, L * R);
+                return E;
+            case '<':
+                // fcmp ult is also true if either side is NaN
+                AST.makeNumber(E, !(L >= R) ? 1.0 : 0.0);
+                return E;
+            default:
+                return E;
+            }
+        }
+        switch (AST.opcode(E)) {
+        case '*':
+            if (isNumber(RHS, 1.0))
+                return LHS;
+            if (isNumber(LHS, 1.0))
+                return RHS;
+            return E;
+        case '+':
+            if (isNumber(RHS, -0.0))
+                return LHS;
+            if (isNumber(LHS, -0.0))
+                return RHS;
+            return E;
+        case '-':
+            if (isNumber(RHS, 0.0))
+                return LHS;
+            return E;
+        default:
+            return E;
+        }
     }
-    return nullptr;
+    case Expr_If: {
+        // the condition is true if it compares ordered and not equal to zero
+        ExprId Cond = AST.operand(E, 0);
+        if (AST.kind(Cond) != Expr_Number)
+            return E;
+        double C = AST.number(Cond);
+        return C < 0.0 || C > 0.0 ? AST.operand(E, 1) : AST.operand(E, 2);
+    }
+    default:
+        return E;
+    }
+}
+
+// simplifyExpr - constant fold and simplify the expression rooted at Root,
+// returning the node that now computes it. Operands come before the nodes
+// that use them in the table, so a single forward walk sees every operand
+// simplified before its user, without recursion.
+static ExprId simplifyExpr(ExprId Root) {
+    ExprTable &AST = State->AST;
+    TimeRegion T(phaseTimer(SimplifyTimer));
+    static thread_local std::vector<ExprId> Replacement;
+    Replacement.resize(Root + 1);
+
+    for (ExprId E = 0; E <= Root; ++E) {
+        ArrayRef<ExprId> Operands = AST.operands(E);
+        for (unsigned i = 0, e = Operands.size(); i != e; ++i)
+            if (Operands[i] != NoExpr)
+                AST.setOperand(E, i, Replacement[Operands[i]]);
+
+        ExprKind Kind = AST.kind(E);
+        Replacement[E] = simplifyNode(E);
+        if (Replacement[E] != E || AST.kind(E) != Kind)
+            ++State->NumFolded;
+    }
+    return Replacement[Root];
+}
+
+void FunctionAST::simplify() { Body = simplifyExpr(Body); }
+
+static void setPrototype(std::unique_ptr<PrototypeAST> Proto) {
+    SymbolId Sym = Proto->getSymbol();
+    if (Sym >= State->FunctionProtos.size()) {
+        State->FunctionProtos.resize(Sym + 1);
+        State->PrototypeVersions.resize(Sym + 1);
+    }
+    State->FunctionProtos[Sym] = std::move(Proto);
+    State->PrototypeVersions[Sym] = ++State->NumPrototypesSet;
+}
+
+static void setInsertBlock(BasicBlock *BB) {
+    State->Builder->SetInsertPoint(BB);
+    ++State->CodegenEpoch;
 }
 
-static std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+static void pushBinding(SymbolId Sym, Value *V) {
+    ++State->CodegenEpoch;
+    State->ScopeStack.push_back(std::make_pair(Sym, State->NamedValues[Sym]));
+    State->NamedValues[Sym] = V;
+}
+
+// isBufferBinding - whether binding V is a buffer rather than a number
+static bool isBufferBinding(Value *V) {
+    return isa<Argument>(V) && V->getType()->isPointerTy();
+}
+
+// bufferLength - the i64 length of a buffer, the argument after its pointer
+static Value *bufferLength(Value *Buf) {
+    auto *A = cast<Argument>(Buf);
+    return &*std::next(A->getParent()->arg_begin(), A->getArgNo() + 1);
+}
+
+static void popBindings(size_t Mark) {
+    ++State->CodegenEpoch;
+    while (State->ScopeStack.size() > Mark) {
+        auto &Binding = State->ScopeStack.back();
+        State->NamedValues[Binding.first] = Binding.second;
+        State->ScopeStack.pop_back();
+    }
+}
+
+// getLiveSymbols - the number variables in scope, each once. With
+// -direct-ssa these are the values an if has to merge and a loop header has
+// to carry.
+static void getLiveSymbols(SmallVectorImpl<SymbolId> &Syms) {
+    SmallDenseSet<SymbolId, 16> Seen;
+    for (auto &Binding : State->ScopeStack)
+        if (!isBufferBinding(State->NamedValues[Binding.first]) &&
+            Seen.insert(Binding.first).second)
+            Syms.push_back(Binding.first);
+}
+
+// sealLoopPhis - add nothing further to a loop's header phis, and remove the
+// ones that turned out trivial: the variable wasn't assigned in the loop, so
+// every incoming value is the same or the phi itself. Removing one can make
+// phis that use it trivial in turn.
+static void sealLoopPhis(ArrayRef<PHINode *> Phis) {
+    for (PHINode *PN : Phis)
+        State->UnsealedPhis.erase(PN);
+
+    SmallVector<PHINode *, 8> Worklist(Phis.begin(), Phis.end());
+    SmallPtrSet<PHINode *, 8> Dead;
+    while (!Worklist.empty()) {
+        PHINode *PN = Worklist.pop_back_val();
+        if (Dead.count(PN) || State->UnsealedPhis.count(PN))
+            continue;
+        Value *V = PN->hasConstantValue();
+        if (!V)
+            continue;
+
+        for (User *U : PN->users())
+            if (auto *UserPN = dyn_cast<PHINode>(U))
+                if (UserPN != PN)
+                    Worklist.push_back(UserPN);
+        PN->replaceAllUsesWith(V);
+        Dead.insert(PN);
+
+        // the bindings are the only other place a phi is referenced from
+        for (auto &Binding : State->ScopeStack) {
+            if (Binding.second == PN)
+                Binding.second = V;
+            if (State->NamedValues[Binding.first] == PN)
+                State->NamedValues[Binding.first] = V;
+        }
+    }
+
+    for (PHINode *PN : Dead)
+        PN->eraseFromParent();
+}
 
 // CreateEntryBlockAlloca - Create an alloca instruction in the entry block of
 // the function. This is used for mutable variables, etc.
 static AllocaInst *CreateEntryBlockAlloca(Function *TheFunction,
-                                            const std::string &VarName){
+                                            StringRef VarName){
     IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
                     TheFunction->getEntryBlock().begin());
-    return TmpB.CreateAlloca(Type::getDoubleTy(TheContext), 0, VarName.c_str());
+    return TmpB.CreateAlloca(Type::getDoubleTy(*State->TheContext), 0, VarName);
 }
 
-Function *getFunction(std::string Name){
+Function *getFunction(SymbolId Sym){
     // see if function has already been added to the current module
-    if (auto *F = TheModule->getFunction(Name))
+    if (auto *F = State->TheModule->getFunction(symbolName(Sym)))
         return F;
 
     // if not, check whether we can codegen the declaration from some existing prototype
-    auto FI = FunctionProtos.find(Name);
-    if (FI != FunctionProtos.end())
-        return FI->second->codegen();
+    if (Sym < State->FunctionProtos.size() && State->FunctionProtos[Sym])
+        return State->FunctionProtos[Sym]->codegen();
 
     return nullptr;
 }
 
-Value *NumberExprAST::codegen() {
-    return ConstantFP::get(TheContext, APFloat(Val));
-}
+static Value *codegenExpr(ExprId E);
 
-Value *VariableExprAST::codegen() {
+static Value *codegenVariable(ExprId E) {
     // look up this variable in the function
-    Value *V = NamedValues[Name];
+    SymbolId Sym = State->AST.symbol(E);
+    Value *V = State->NamedValues[Sym];
     if (!V)
-        LogErrorV("Unknown variable name");
+        return LogErrorV("Unknown variable name");
+
+    // with direct SSA the binding is the value itself, as it is for a buffer
+    if (State->Options.DirectSSA || isBufferBinding(V))
+        return V;
 
     // load the value.
-    return Builder.CreateLoad(V, Name.c_str());
+    return State->Builder->CreateLoad(V, symbolName(Sym));
 }
 
-Value *BinaryExprAST::codegen() {
+// codegenBinary - emit binary operator E given the values of its operands.
+// For '=' only the RHS has been emitted and is passed as R.
+static Value *codegenBinary(ExprId E, Value *L, Value *R) {
+    ExprTable &AST = State->AST;
+    char Op = AST.opcode(E);
+
     // special case '=' because we don't want to emit the LHS as an expression
     if (Op == '='){
         // assignment requires the LHS to be an identifier
-        VariableExprAST *LHSE = static_cast<VariableExprAST*>(LHS.get());
-        if (!LHSE)
+        ExprId LHS = AST.operand(E, 0);
+        if (AST.kind(LHS) != Expr_Variable)
             return LogErrorV("destiniation of '=' must be a variable");
 
-        // codegen the RHS
-        Value *Val = RHS->codegen();
-        if (Val)
-            return nullptr;
-
         // look up the name
-        Value *Variable = NamedValues[LHSE->getName()];
+        Value *&Variable = State->NamedValues[AST.symbol(LHS)];
         if (!Variable)
             return LogErrorV("unknown variable name");
-
-        Builder.CreateStore(Val, Variable);
-        return Val;
+        if (isBufferBinding(Variable))
+            return LogErrorV("can't assign to a buffer, only to its elements");
+
+        // with direct SSA, assigning just rebinds the variable to the value
+        if (State->Options.DirectSSA)
+            Variable = R;
+        else
+            State->Builder->CreateStore(R, Variable);
+        ++State->CodegenEpoch;
+        return R;
     }
 
-    Value *L = LHS->codegen();
-    Value *R = RHS->codegen();
-    if (!L || !R)
-        return nullptr;
-
     switch (Op){
     case '+':
-        return Builder.CreateFAdd(L, R, "addtmp");
+        return State->Builder->CreateFAdd(L, R, "addtmp");
     case '-':
-        return Builder.CreateFSub(L, R, "addtmp");
+        return State->Builder->CreateFSub(L, R, "addtmp");
     case '*':
-        return Builder.CreateFMul(L, R, "addtmp");
+        return State->Builder->CreateFMul(L, R, "addtmp");
     case '<':
-        L = Builder.CreateFCmpULT(L, R, "addtmp");
+        L = State->Builder->CreateFCmpULT(L, R, "addtmp");
         // convert boolean 0 or 1 to double 0.0 or 1.0
-        return Builder.CreateUIToFP(L, Type::getDoubleTy(TheContext), "booltmp");
+        return State->Builder->CreateUIToFP(L, Type::getDoubleTy(*State->TheContext), "booltmp");
     default:
         break;
     }
 
     // if it wasn't a builtin binary operator, it must be a user defined one. emit
     // a call to it.
-    Function *F = getFunction(std::string("binary") + Op);
+    Function *F = getFunction(getOperatorSymbol(true, Op));
     assert(F && "binary operator not found!");
 
     Value *Ops[2] = { L, R };
-    return Builder.CreateCall(F, Ops, "binop");
+    return State->Builder->CreateCall(F, Ops, "binop");
 }
 
-Value *VarExprAST::codegen() {
-    std::vector<AllocaInst *> OldBindings;
+static Value *codegenVar(ExprId E) {
+    ExprTable &AST = State->AST;
+    ArrayRef<ExprId> Inits = AST.operands(E).drop_back();
+    ExprId Body = AST.operands(E).back();
+    size_t ScopeMark = State->ScopeStack.size();
 
-    Function *TheFunction = Builder.GetInsertBlock()->getParent();
+    Function *TheFunction = State->Builder->GetInsertBlock()->getParent();
 
     // register all variables and emit their initializer
-    for (unsigned i = 0, e = VarNames.size(); i != e; ++i){
-        const std::string &VarName = VarNames[i].first;
-        ExprAST *Init = VarNames[i].second.get();
+    for (unsigned i = 0, e = Inits.size(); i != e; ++i){
+        SymbolId VarName = AST.varSymbol(E, i);
+        ExprId Init = Inits[i];
 
         // emit the initializer before adding the variable to scope, this prevents
         // the initializer from referencing the variable itself, and permits stuff
@@ -792,302 +1932,1214 @@ Value *VarExprAST::codegen() {
         //      var a = 1 in
         //          var a = a in ..   # refers to outer 'a'
         Value *InitVal;
-        if (Init){
-            InitVal = Init->codegen();
+        if (Init != NoExpr){
+            InitVal = codegenExpr(Init);
             if (!InitVal)
                 return nullptr;
         } else { // if not specified, use 0.0
-            InitVal = ConstantFP::get(TheContext, APFloat(0.0));
+            InitVal = ConstantFP::get(*State->TheContext, APFloat(0.0));
         }
 
-        AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
-        Builder.CreateStore(InitVal, Alloca);
-
-        // remember the old variable binding so that we can restore the binding when
-        // we unrecurse
-        OldBindings.push_back(NamedValues[VarName]);
+        // remember this binding, and the one it shadows so that we can
+        // restore it when we unrecurse
+        if (State->Options.DirectSSA) {
+            pushBinding(VarName, InitVal);
+            continue;
+        }
 
-        // remember this binding
-        NamedValues[VarName] = Alloca;
+        AllocaInst *Alloca =
+            CreateEntryBlockAlloca(TheFunction, symbolName(VarName));
+        State->Builder->CreateStore(InitVal, Alloca);
+        pushBinding(VarName, Alloca);
     }
 
     // codegen the body, now that all vars are in scope
-    Value *BodyVal = Body->codegen();
+    Value *BodyVal = codegenExpr(Body);
     if (!BodyVal)
         return nullptr;
 
     // pop all our variables from scope
-    for (unsigned i = 0, e = VarNames.size(); i != e; ++i)
-        NamedValues[VarNames[i].first] = OldBindings[i];
+    popBindings(ScopeMark);
 
     // return the body computation
     return BodyVal;
 }
 
-Value *UnaryExprAST::codegen() {
-    Value *OperandV = Operand->codegen();
-    if (!OperandV)
-        return nullptr;
-
-    Function *F = getFunction(std::string("unary") + Opcode);
+static Value *codegenUnary(ExprId E, Value *OperandV) {
+    Function *F = getFunction(getOperatorSymbol(false, State->AST.opcode(E)));
     if (!F)
         return LogErrorV("Unknown unary operator");
 
-    return Builder.CreateCall(F, OperandV, "unop");
+    return State->Builder->CreateCall(F, OperandV, "unop");
 }
 
-Value *IfExprAST::codegen(){
-    Value *CondV = Cond->codegen();
+static Value *codegenIf(ExprId E){
+    ExprTable &AST = State->AST;
+    Value *CondV = codegenExpr(AST.operand(E, 0));
     if (!CondV)
         return nullptr;
 
     // convert condition to a bool by comparing non-equal to 0.0
-    CondV = Builder.CreateFCmpONE(
-        CondV, ConstantFP::get(TheContext, APFloat(0.0)), "ifcond");
-
-    Function *TheFunction = Builder.GetInsertBlock()->getParent();
+    CondV = State->Builder->CreateFCmpONE(
+        CondV, ConstantFP::get(*State->TheContext, APFloat(0.0)), "ifcond");
+
+    Function *TheFunction = State->Builder->GetInsertBlock()->getParent();
+
+    // with direct SSA, each branch starts from the values the variables have
+    // before the if, and the ones a branch assigns are merged by phis
+    SmallVector<SymbolId, 8> Live;
+    SmallVector<Value *, 8> Before, ThenVals;
+    if (State->Options.DirectSSA) {
+        getLiveSymbols(Live);
+        for (SymbolId Sym : Live)
+            Before.push_back(State->NamedValues[Sym]);
+    }
 
     // create blocks for the then and else cases. Insert the 'then' block at the end of the function
-    BasicBlock *ThenBB = BasicBlock::Create(TheContext, "then", TheFunction);
-    BasicBlock *ElseBB = BasicBlock::Create(TheContext, "else");
-    BasicBlock *MergeBB = BasicBlock::Create(TheContext, "ifcont");
+    BasicBlock *ThenBB =
+        BasicBlock::Create(*State->TheContext, "then", TheFunction);
+    BasicBlock *ElseBB = BasicBlock::Create(*State->TheContext, "else");
+    BasicBlock *MergeBB = BasicBlock::Create(*State->TheContext, "ifcont");
 
-    Builder.CreateCondBr(CondV, ThenBB, ElseBB);
+    State->Builder->CreateCondBr(CondV, ThenBB, ElseBB);
 
     // emit then value
-    Builder.SetInsertPoint(ThenBB);
+    setInsertBlock(ThenBB);
 
-    Value *ThenV = Then->codegen();
+    Value *ThenV = codegenExpr(AST.operand(E, 1));
     if(!ThenV)
         return nullptr;
 
-    Builder.CreateBr(MergeBB);
+    State->Builder->CreateBr(MergeBB);
     // codegen of 'Then' can change the current block, update ThenBB for the PHI
-    ThenBB = Builder.GetInsertBlock();
+    ThenBB = State->Builder->GetInsertBlock();
+
+    for (unsigned i = 0, e = Live.size(); i != e; ++i) {
+        ThenVals.push_back(State->NamedValues[Live[i]]);
+        State->NamedValues[Live[i]] = Before[i];
+    }
 
     // emit else block
     TheFunction->getBasicBlockList().push_back(ElseBB);
-    Builder.SetInsertPoint(ElseBB);
+    setInsertBlock(ElseBB);
 
-    Value *ElseV = Else->codegen();
+    Value *ElseV = codegenExpr(AST.operand(E, 2));
     if (!ElseV)
         return nullptr;
 
-    Builder.CreateBr(MergeBB);
+    State->Builder->CreateBr(MergeBB);
     // codegen of 'Else' can change the current block, update ElseBB for the PHI.
-    ElseBB = Builder.GetInsertBlock();
+    ElseBB = State->Builder->GetInsertBlock();
 
     // emit merge block
     TheFunction->getBasicBlockList().push_back(MergeBB);
-    Builder.SetInsertPoint(MergeBB);
-    PHINode *PN =
-        Builder.CreatePHI(Type::getDoubleTy(TheContext), 2, "iftmp");
+    setInsertBlock(MergeBB);
+    PHINode *PN = State->Builder->CreatePHI(
+        Type::getDoubleTy(*State->TheContext), 2, "iftmp");
 
     PN->addIncoming(ThenV, ThenBB);
     PN->addIncoming(ElseV, ElseBB);
-    return PN;
+
+    for (unsigned i = 0, e = Live.size(); i != e; ++i) {
+        Value *ElseVal = State->NamedValues[Live[i]];
+        if (ThenVals[i] == ElseVal)
+            continue;
+        PHINode *VarPN = State->Builder->CreatePHI(
+            Type::getDoubleTy(*State->TheContext), 2, symbolName(Live[i]));
+        VarPN->addIncoming(ThenVals[i], ThenBB);
+        VarPN->addIncoming(ElseVal, ElseBB);
+        State->NamedValues[Live[i]] = VarPN;
+    }
+    ++State->CodegenEpoch;
+    return PN;
+}
+
+// assignsAny - whether the expression at Root assigns any of Syms
+static bool assignsAny(ExprId Root, ArrayRef<SymbolId> Syms) {
+    ExprTable &AST = State->AST;
+    SmallVector<ExprId, 16> Stack(1, Root);
+    DenseSet<ExprId> Seen;
+    while (!Stack.empty()) {
+        ExprId E = Stack.pop_back_val();
+        if (AST.kind(E) == Expr_Binary && AST.opcode(E) == '=' &&
+            is_contained(Syms, AST.symbol(AST.operand(E, 0))))
+            return true;
+        for (ExprId Op : AST.operands(E))
+            if (Op != NoExpr && Seen.insert(Op).second)
+                Stack.push_back(Op);
+    }
+    return false;
+}
+
+// isLengthCall - whether E is len(a) for a buffer a
+static bool isLengthCall(ExprId E) {
+    ExprTable &AST = State->AST;
+    if (AST.kind(E) != Expr_Call || AST.operands(E).size() != 1 ||
+        symbolName(AST.symbol(E)) != "len")
+        return false;
+    ExprId Arg = AST.operand(E, 0);
+    return AST.kind(Arg) == Expr_Variable &&
+           State->NamedValues[AST.symbol(Arg)] &&
+           isBufferBinding(State->NamedValues[AST.symbol(Arg)]);
 }
 
-Value *ForExprAST::codegen(){
+// pureVariables - whether the expression at Root is only numbers, variables,
+// buffer lengths and builtin operators, adding the variables it reads to Vars
+// if so
+static bool pureVariables(ExprId Root, SmallVectorImpl<SymbolId> &Vars) {
+    ExprTable &AST = State->AST;
+    SmallVector<ExprId, 16> Stack(1, Root);
+    DenseSet<ExprId> Seen;
+    while (!Stack.empty()) {
+        ExprId E = Stack.pop_back_val();
+        switch (AST.kind(E)) {
+        case Expr_Number:
+            break;
+        case Expr_Variable:
+            Vars.push_back(AST.symbol(E));
+            break;
+        case Expr_Call:
+            if (!isLengthCall(E))
+                return false;
+            break;
+        case Expr_Binary:
+            if (!isPureBinop(AST.opcode(E)))
+                return false;
+            for (ExprId Op : AST.operands(E))
+                if (Seen.insert(Op).second)
+                    Stack.push_back(Op);
+            break;
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+// isIntegral - whether V is an integer that doubles represent exactly, as
+// are all those between it and zero, up to Limit
+static bool isIntegral(double V, double Limit) {
+    return std::trunc(V) == V && std::fabs(V) <= Limit;
+}
+
+// IntegerLoop - a for loop that counts up in integers to a bound: it starts
+// at an integral constant, steps by a positive integral constant, nothing in
+// it assigns the variable, and its condition is 'variable < X', with X
+// computed from numbers, buffer lengths and variables the loop doesn't
+// assign, so it can be evaluated before the loop and the exit tested on
+// integers
+struct IntegerLoop {
+    int64_t Start = 0, Step = 1;
+    ExprId Bound = NoExpr;
+};
+
+// matchIntegerLoop - whether for loop E counts in integers, and how
+static bool matchIntegerLoop(ExprId E, IntegerLoop &L) {
+    ExprTable &AST = State->AST;
+    SymbolId VarName = AST.symbol(E);
+    ExprId Init = AST.operand(E, 0), Cond = AST.operand(E, 1),
+           Step = AST.operand(E, 2), Body = AST.operand(E, 3);
+
+    // beyond 2^53 the double variable stops counting exactly, so the loops
+    // have to stay within it, which emitIntegerBound sees to
+    const double MaxStart = std::ldexp(1.0, 52), MaxStep = std::ldexp(1.0, 32);
+    if (AST.kind(Init) != Expr_Number ||
+        !isIntegral(AST.number(Init), MaxStart))
+        return false;
+    if (Step != NoExpr &&
+        (AST.kind(Step) != Expr_Number ||
+         !isIntegral(AST.number(Step), MaxStep) || AST.number(Step) <= 0))
+        return false;
+    if (assignsAny(Body, VarName) || assignsAny(Cond, VarName))
+        return false;
+    L.Start = (int64_t)AST.number(Init);
+    L.Step = Step == NoExpr ? 1 : (int64_t)AST.number(Step);
+
+    SmallVector<SymbolId, 8> Vars;
+    if (AST.kind(Cond) != Expr_Binary || AST.opcode(Cond) != '<' ||
+        AST.kind(AST.operand(Cond, 0)) != Expr_Variable ||
+        AST.symbol(AST.operand(Cond, 0)) != VarName ||
+        !pureVariables(AST.operand(Cond, 1), Vars) ||
+        is_contained(Vars, VarName) || assignsAny(Body, Vars))
+        return false;
+    ExprId Bound = AST.operand(Cond, 1);
+
+    // a constant bound that emitIntegerBound would cut short is left to the
+    // double loop
+    if (AST.kind(Bound) == Expr_Number &&
+        !(AST.number(Bound) <= std::ldexp(1.0, 53) - L.Step + 1))
+        return false;
+    L.Bound = Bound;
+    return true;
+}
+
+// emitIntegerBound - for X, the B such that an integer i is less than B
+// exactly when (double)i < X. The comparison is fcmp ult, which NaN
+// satisfies, so NaN is as good as infinity. B is kept to 2^53 - Step + 1, so
+// that the variable, which is at most B - 1 + Step, stays where doubles
+// count exactly and the two loops see the same values. A loop whose bound is
+// beyond that, only known when it runs, stops there rather than going on in
+// rounded steps.
+static Value *emitIntegerBound(Value *X, int64_t Step) {
+    Type *DoubleTy = Type::getDoubleTy(*State->TheContext);
+    Constant *Max = ConstantFP::get(DoubleTy, std::ldexp(1.0, 53) - Step + 1);
+    Constant *Min = ConstantFP::get(DoubleTy, -std::ldexp(1.0, 53));
+    IRBuilder<> &Builder = *State->Builder;
+    X = Builder.CreateSelect(Builder.CreateFCmpUNO(X, X), Max, X);
+    X = Builder.CreateSelect(Builder.CreateFCmpOGT(X, Max), Max, X);
+    X = Builder.CreateSelect(Builder.CreateFCmpOLT(X, Min), Min, X);
+    Function *Ceil = Intrinsic::getDeclaration(State->TheModule.get(),
+                                               Intrinsic::ceil, DoubleTy);
+    X = Builder.CreateCall(Ceil, X);
+    return Builder.CreateFPToSI(X, Type::getInt64Ty(*State->TheContext),
+                                "bound");
+}
+
+// makeLoopID - a loop ID for a loop's back edge, which the vectorizer and
+// unroller record what they did to the loop on
+static MDNode *makeLoopID() {
+    Metadata *Self = nullptr;
+    MDNode *ID = MDNode::getDistinct(*State->TheContext, Self);
+    ID->replaceOperandWith(0, ID);
+    return ID;
+}
+
+// codegenFor - emit a for loop. One that counts in integers gets an i64
+// induction variable, the double variable being converted from it, so that
+// the loop passes can tell how many times it runs, and vectorize it.
+static Value *codegenFor(ExprId E){
+    const CompilerOptions &Options = State->Options;
+    ExprTable &AST = State->AST;
+    SymbolId VarName = AST.symbol(E);
+    ExprId Init = AST.operand(E, 0), Cond = AST.operand(E, 1),
+           Step = AST.operand(E, 2), Body = AST.operand(E, 3);
+    IntegerLoop IL;
+    bool IntegerIV = matchIntegerLoop(E, IL);
+
     // make the new basic block for the loop header, inserting after current block
-    Function *TheFunction = Builder.GetInsertBlock()->getParent();
+    Function *TheFunction = State->Builder->GetInsertBlock()->getParent();
 
     // Create an alloca for the variable in the entry block.
-    AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
+    AllocaInst *Alloca = nullptr;
+    if (!Options.DirectSSA)
+        Alloca = CreateEntryBlockAlloca(TheFunction, symbolName(VarName));
 
     // emit the start code first, without 'variable' in scope
-    Value *InitVal = Init->codegen();
+    Value *InitVal = codegenExpr(Init);
     if (!InitVal)
         return nullptr;
 
     // store the value into the alloca
-    Builder.CreateStore(InitVal, Alloca);
+    if (!Options.DirectSSA)
+        State->Builder->CreateStore(InitVal, Alloca);
+
+    // the loop's bound, if it can be evaluated once up front
+    Value *BoundVal = nullptr;
+    if (IL.Bound != NoExpr) {
+        BoundVal = codegenExpr(IL.Bound);
+        if (!BoundVal)
+            return nullptr;
+        BoundVal = emitIntegerBound(BoundVal, IL.Step);
+    }
+    BasicBlock *PreheaderBB = State->Builder->GetInsertBlock();
 
     // make the new basic block for the loop header, inserting after current block.
-    BasicBlock *LoopBB = BasicBlock::Create(TheContext, "loop", TheFunction);
+    BasicBlock *LoopBB =
+        BasicBlock::Create(*State->TheContext, "loop", TheFunction);
 
     // insert an explicit fall through from the current block to the LoopBB
-    Builder.CreateBr(LoopBB);
+    State->Builder->CreateBr(LoopBB);
 
     // start insertion in LoopBB
-    Builder.SetInsertPoint(LoopBB);
+    setInsertBlock(LoopBB);
 
     // within the loop, the variable is defined equal to the phi node. If it
     // shadows an existing variable, we have to restore it, so save it now
-    AllocaInst *OldVal = NamedValues[VarName];
-    NamedValues[VarName] = Alloca;
+    size_t ScopeMark = State->ScopeStack.size();
+    pushBinding(VarName, Options.DirectSSA ? InitVal : Alloca);
+
+    // with direct SSA, every variable in scope gets a phi in the loop header,
+    // since the body may assign it. The back edge values are added once the
+    // body is done, and the phis of variables it didn't assign are removed.
+    SmallVector<SymbolId, 8> Live;
+    SmallVector<PHINode *, 8> Phis;
+    if (Options.DirectSSA) {
+        getLiveSymbols(Live);
+        // the variable of an integer loop is never assigned
+        if (IntegerIV)
+            Live.erase(std::find(Live.begin(), Live.end(), VarName));
+        for (SymbolId Sym : Live) {
+            PHINode *PN = State->Builder->CreatePHI(
+                Type::getDoubleTy(*State->TheContext), 2, symbolName(Sym));
+            PN->addIncoming(State->NamedValues[Sym], PreheaderBB);
+            State->NamedValues[Sym] = PN;
+            Phis.push_back(PN);
+            State->UnsealedPhis.insert(PN);
+        }
+        ++State->CodegenEpoch;
+    }
+
+    // the integer induction variable, which the variable is converted from
+    Type *Int64Ty = Type::getInt64Ty(*State->TheContext);
+    PHINode *IV = nullptr;
+    if (IntegerIV) {
+        IV = State->Builder->CreatePHI(Int64Ty, 2, "iv");
+        IV->addIncoming(ConstantInt::get(Int64Ty, IL.Start), PreheaderBB);
+        Value *Var = State->Builder->CreateSIToFP(
+            IV, Type::getDoubleTy(*State->TheContext), symbolName(VarName));
+        if (Options.DirectSSA)
+            State->NamedValues[VarName] = Var;
+        else
+            State->Builder->CreateStore(Var, Alloca);
+    }
 
     // emit the body of the loop. this, like any other expr, can change the
     // current BB. Note that we ignore the value computed by the body, but don't
     // allow an error
-    if (!Body->codegen())
+    if (!codegenExpr(Body))
         return nullptr;
 
-    // emit the step value
-    Value *StepVal = nullptr;
-    if (Step){
-        StepVal = Step->codegen();
-        if (!StepVal)
-            return nullptr;
+    Value *EndCond;
+    if (IntegerIV) {
+        // the end condition, on the integers, then the step, which can't
+        // overflow as the variable stays within 2^53
+        EndCond = State->Builder->CreateICmpSLT(IV, BoundVal, "loopcond");
+        Value *StepVal = ConstantInt::get(Int64Ty, IL.Step);
+        IV->addIncoming(State->Builder->CreateNSWAdd(IV, StepVal, "nextiv"),
+                        State->Builder->GetInsertBlock());
     } else {
-        // if not specified, use 1.0
-        StepVal = ConstantFP::get(TheContext, APFloat(1.0));
-    }
+        // emit the step value
+        Value *StepVal = nullptr;
+        if (Step != NoExpr){
+            StepVal = codegenExpr(Step);
+            if (!StepVal)
+                return nullptr;
+        } else {
+            // if not specified, use 1.0
+            StepVal = ConstantFP::get(*State->TheContext, APFloat(1.0));
+        }
 
-    // compute the end condition
-    Value *EndCond = Cond->codegen();
-    if (!EndCond)
-        return nullptr;
+        // compute the end condition
+        EndCond = codegenExpr(Cond);
+        if (!EndCond)
+            return nullptr;
 
-    // reload, increment, and restore the alloca. This handles the case where
-    // the body of the loop mutates the variable
-    Value *CurVar = Builder.CreateLoad(Alloca, VarName.c_str());
-    Value *NextVar = Builder.CreateFAdd(CurVar, StepVal, "nextvar");
-    Builder.CreateStore(NextVar, Alloca);
+        // reload, increment, and restore the alloca. This handles the case
+        // where the body of the loop mutates the variable
+        if (Options.DirectSSA) {
+            State->NamedValues[VarName] =
+                State->Builder->CreateFAdd(State->NamedValues[VarName], StepVal,
+                                           "nextvar");
+        } else {
+            Value *CurVar =
+                State->Builder->CreateLoad(Alloca, symbolName(VarName));
+            Value *NextVar =
+                State->Builder->CreateFAdd(CurVar, StepVal, "nextvar");
+            State->Builder->CreateStore(NextVar, Alloca);
+        }
+    }
 
     // convert condition to a bool by comparing non-equal to 0.0
-    EndCond = Builder.CreateFCmpONE(
-        EndCond, ConstantFP::get(TheContext, APFloat(0.0)), "loopcond");
+    if (!BoundVal)
+        EndCond = State->Builder->CreateFCmpONE(
+            EndCond, ConstantFP::get(*State->TheContext, APFloat(0.0)),
+            "loopcond");
 
     BasicBlock *AfterBB =
-        BasicBlock::Create(TheContext, "afterloop", TheFunction);
+        BasicBlock::Create(*State->TheContext, "afterloop", TheFunction);
 
     // insert the conditional branch into the end of LoopEndBB
-    Builder.CreateCondBr(EndCond, LoopBB, AfterBB);
+    BasicBlock *LoopEndBB = State->Builder->GetInsertBlock();
+    State->Builder->CreateCondBr(EndCond, LoopBB, AfterBB)
+        ->setMetadata(LLVMContext::MD_loop, makeLoopID());
+
+    for (unsigned i = 0, e = Live.size(); i != e; ++i)
+        Phis[i]->addIncoming(State->NamedValues[Live[i]], LoopEndBB);
+    sealLoopPhis(Phis);
 
     // any new code will be inserted in AfterBB
-    Builder.SetInsertPoint(AfterBB);
+    setInsertBlock(AfterBB);
 
     // restore the unshadowed Variable
-    if (OldVal)
-        NamedValues[VarName] = OldVal;
-    else
-        NamedValues.erase(VarName);
+    popBindings(ScopeMark);
 
     // for expr always returns 0.0
-    return Constant::getNullValue(Type::getDoubleTy(TheContext));
+    return Constant::getNullValue(Type::getDoubleTy(*State->TheContext));
 }
 
 
-Value *CallExprAST::codegen(){
+static Value *codegenCall(ExprId E, ArrayRef<Value *> ArgsV){
+    SymbolId Sym = State->AST.symbol(E);
+
+    // len(a) is builtin for a buffer a
+    if (ArgsV.size() == 1 && ArgsV[0]->getType()->isPointerTy() &&
+        symbolName(Sym) == "len")
+        return State->Builder->CreateSIToFP(bufferLength(ArgsV[0]),
+                                            Type::getDoubleTy(*State->TheContext), "len");
+
     // look up the name in the global module table
-    Function *CalleeF = getFunction(Callee);
+    Function *CalleeF = getFunction(Sym);
     if (!CalleeF)
         return LogErrorV("Unknown function referenced");
 
     // if argument mismatch error
-    if (CalleeF->arg_size() != Args.size())
+    const PrototypeAST *P =
+        Sym < State->FunctionProtos.size() ? State->FunctionProtos[Sym].get()
+                                           : nullptr;
+    if ((P ? P->getArgs().size() : CalleeF->arg_size()) != ArgsV.size())
         return LogErrorV("Incorrect # of arguments passed");
 
-    std::vector<Value *> ArgsV;
-    for (unsigned i = 0, e = Args.size(); i != e; ++i){
-        ArgsV.push_back(Args[i]->codegen());
-        if (!ArgsV.back())
+    // a buffer is passed as its pointer and its length
+    SmallVector<Value *, 8> Actuals;
+    for (unsigned i = 0, e = ArgsV.size(); i != e; ++i) {
+        bool IsBuffer = ArgsV[i]->getType()->isPointerTy();
+        if (IsBuffer != (P && P->isBuffer(i)))
+            return LogErrorV(IsBuffer ? "buffer passed for a number argument"
+                                      : "number passed for a buffer argument");
+        Actuals.push_back(ArgsV[i]);
+        if (!IsBuffer)
+            continue;
+        // the callee's buffers are noalias, so they must not overlap
+        if (is_contained(ArgsV.take_front(i), ArgsV[i]))
+            return LogErrorV("buffer passed twice in one call");
+        Actuals.push_back(bufferLength(ArgsV[i]));
+    }
+    if (CalleeF->arg_size() != Actuals.size())
+        return LogErrorV("Incorrect # of arguments passed");
+
+    return State->Builder->CreateCall(CalleeF, Actuals, "calltmp");
+}
+
+// emitIndex - the i64 index of the element at X. The variable of an integer
+// loop is converted from its counter, so the counter, plus or minus a
+// constant, is used as it is and the loop passes see which elements each
+// iteration accesses. Anything else is truncated toward zero.
+static Value *emitIndex(Value *X) {
+    Type *Int64Ty = Type::getInt64Ty(*State->TheContext);
+    auto counter = [&](Value *V) -> Value * {
+        auto *Conv = dyn_cast<SIToFPInst>(V);
+        return Conv && Conv->getSrcTy() == Int64Ty ? Conv->getOperand(0)
+                                                   : nullptr;
+    };
+    auto offset = [](Value *V, double &C) {
+        auto *CF = dyn_cast<ConstantFP>(V);
+        if (!CF)
+            return false;
+        C = CF->getValueAPF().convertToDouble();
+        return isIntegral(C, std::ldexp(1.0, 32));
+    };
+
+    if (Value *I = counter(X))
+        return I;
+    if (auto *BO = dyn_cast<BinaryOperator>(X)) {
+        Value *L = BO->getOperand(0), *R = BO->getOperand(1);
+        double C;
+        if (BO->getOpcode() == Instruction::FAdd && !counter(L))
+            std::swap(L, R);
+        if ((BO->getOpcode() == Instruction::FAdd ||
+             BO->getOpcode() == Instruction::FSub) &&
+            counter(L) && offset(R, C)) {
+            if (BO->getOpcode() == Instruction::FSub)
+                C = -C;
+            return State->Builder->CreateNSWAdd(
+                counter(L), ConstantInt::get(Int64Ty, (int64_t)C), "idx");
+        }
+    }
+    return State->Builder->CreateFPToSI(X, Int64Ty, "idx");
+}
+
+// elementAddress - the address of the element at X of the buffer Sym.
+// Indexes aren't checked against the length.
+static Value *elementAddress(SymbolId Sym, Value *X) {
+    Value *Buf = State->NamedValues[Sym];
+    if (!Buf || !isBufferBinding(Buf))
+        return LogErrorV("indexed variable isn't a buffer");
+    return State->Builder->CreateInBoundsGEP(Buf, emitIndex(X), "eltaddr");
+}
+
+static Value *codegenIndex(ExprId E, Value *X) {
+    SymbolId Sym = State->AST.symbol(E);
+    Value *Addr = elementAddress(Sym, X);
+    if (!Addr)
+        return nullptr;
+    return State->Builder->CreateAlignedLoad(Addr, 8, symbolName(Sym));
+}
+
+static Value *codegenStore(ExprId E, Value *X, Value *V) {
+    Value *Addr = elementAddress(State->AST.symbol(E), X);
+    if (!Addr)
+        return nullptr;
+    State->Builder->CreateAlignedStore(V, Addr, 8);
+    return V;
+}
+
+// evaluatedOperands - the operands of E that codegenExpr emits, in order,
+// before E itself. Control flow and scoping constructs emit their own.
+static ArrayRef<ExprId> evaluatedOperands(ExprId E) {
+    ExprTable &AST = State->AST;
+    switch (AST.kind(E)) {
+    case Expr_Binary:
+        // the LHS of an assignment names the variable, it isn't evaluated
+        if (AST.opcode(E) == '=')
+            return AST.operands(E).drop_front();
+        return AST.operands(E);
+    case Expr_Unary:
+    case Expr_Call:
+    case Expr_Index:
+    case Expr_Store:
+        return AST.operands(E);
+    default:
+        return None;
+    }
+}
+
+// isPureExpr - whether the value of E can be reused wherever E appears
+// while CodegenEpoch stays the same. Numbers are constants already.
+static bool isPureExpr(ExprId E) {
+    switch (State->AST.kind(E)) {
+    case Expr_Variable:
+        return true;
+    case Expr_Binary:
+        return isPureBinop(State->AST.opcode(E));
+    default:
+        return false;
+    }
+}
+
+// codegenExpr - emit IR for expression E. Dispatch is a switch on the node
+// kind rather than a virtual call per node. Operator and call operands are
+// walked with an explicit stack, so that expressions millions of operators
+// deep don't overflow the native stack; only if/for/var recurse, as deep as
+// they are nested in the source.
+static Value *codegenExpr(ExprId Root) {
+    ExprTable &AST = State->AST;
+    struct Frame {
+        ExprId E;
+        unsigned NextOperand;
+    };
+    SmallVector<Frame, 16> Frames;
+    SmallVector<Value *, 16> Values;
+
+    Frames.push_back({Root, 0});
+    while (!Frames.empty()) {
+        ExprId E = Frames.back().E;
+        ArrayRef<ExprId> Operands = evaluatedOperands(E);
+        if (Frames.back().NextOperand < Operands.size()) {
+            ExprId Operand = Operands[Frames.back().NextOperand++];
+            auto &Memo = State->CodegenMemo[Operand];
+            if (Memo.first && Memo.second == State->CodegenEpoch) {
+                Values.push_back(Memo.first);
+                ++State->NumMemoHits;
+            } else {
+                Frames.push_back({Operand, 0});
+            }
+            continue;
+        }
+        Frames.pop_back();
+
+        // the values of the operands are on top of the value stack. Only
+        // calls take buffers.
+        ArrayRef<Value *> Args = makeArrayRef(Values).take_back(Operands.size());
+        if (AST.kind(E) != Expr_Call)
+            for (Value *A : Args)
+                if (A->getType()->isPointerTy())
+                    return LogErrorV("buffer used where a number is expected");
+        Value *V = nullptr;
+        switch (AST.kind(E)) {
+        case Expr_Number:
+            V = ConstantFP::get(*State->TheContext, APFloat(AST.number(E)));
+            break;
+        case Expr_Variable:
+            V = codegenVariable(E);
+            break;
+        case Expr_Unary:
+            V = codegenUnary(E, Args[0]);
+            break;
+        case Expr_Binary:
+            V = Args.size() == 2 ? codegenBinary(E, Args[0], Args[1])
+                                 : codegenBinary(E, nullptr, Args[0]);
+            break;
+        case Expr_If:
+            V = codegenIf(E);
+            break;
+        case Expr_For:
+            V = codegenFor(E);
+            break;
+        case Expr_Var:
+            V = codegenVar(E);
+            break;
+        case Expr_Call:
+            V = codegenCall(E, Args);
+            break;
+        case Expr_Index:
+            V = codegenIndex(E, Args[0]);
+            break;
+        case Expr_Store:
+            V = codegenStore(E, Args[0], Args[1]);
+            break;
+        }
+        if (!V)
             return nullptr;
+
+        if (isPureExpr(E))
+            State->CodegenMemo[E] = std::make_pair(V, State->CodegenEpoch);
+        Values.resize(Values.size() - Operands.size());
+        Values.push_back(V);
     }
 
-    return Builder.CreateCall(CalleeF, ArgsV, "calltmp");
+    assert(Values.size() == 1 && "unbalanced codegen stack");
+    if (Values.back()->getType()->isPointerTy())
+        return LogErrorV("buffer used where a number is expected");
+    return Values.back();
 }
 
 Function *PrototypeAST::codegen(){
-    // make the function type: double (double, double) etc.
-    std::vector<Type*> Doubles(Args.size(),
-        Type::getDoubleTy(TheContext));
-    FunctionType *FT =
-        FunctionType::get(Type::getDoubleTy(TheContext), Doubles, false);
+    // make the function type: double (double, double) etc. A buffer is
+    // passed as a pointer to its first element and an i64 length.
+    Type *DoubleTy = Type::getDoubleTy(*State->TheContext);
+    std::vector<Type*> Params;
+    for (unsigned Idx = 0, e = Args.size(); Idx != e; ++Idx) {
+        Params.push_back(isBuffer(Idx) ? DoubleTy->getPointerTo() : DoubleTy);
+        if (isBuffer(Idx))
+            Params.push_back(Type::getInt64Ty(*State->TheContext));
+    }
+    FunctionType *FT = FunctionType::get(DoubleTy, Params, false);
     Function *F =
-        Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
-
-    // set names for all arguments
-    unsigned Idx = 0;
-    for (auto &Arg : F->args())
-        Arg.setName(Args[Idx++]);
+        Function::Create(FT, Function::ExternalLinkage, getName(), State->TheModule.get());
+
+    // set names for all arguments. Calls never pass one buffer twice, so
+    // buffers are noalias, which is what lets loops over them vectorize.
+    auto ArgIt = F->arg_begin();
+    for (unsigned Idx = 0, e = Args.size(); Idx != e; ++Idx) {
+        Argument &Arg = *ArgIt++;
+        Arg.setName(symbolName(Args[Idx]));
+        if (!isBuffer(Idx))
+            continue;
+        F->addParamAttr(Arg.getArgNo(), Attribute::NoAlias);
+        F->addParamAttr(Arg.getArgNo(),
+                        Attribute::getWithAlignment(*State->TheContext, 8));
+        (ArgIt++)->setName(symbolName(Args[Idx]) + ".len");
+    }
 
     return F;
 }
 
-Function *FunctionAST::codegen(){
+// codegen - emit the function, and run the function passes over it unless
+// Optimize is false because that is left until it is compiled
+Function *FunctionAST::codegen(bool Optimize){
 
     // transfer ownership of the protoype to the functionprotos map, but keep a
     // reference to it for use below
     auto &P = *Proto;
-    FunctionProtos[Proto->getName()] = std::move(Proto);
-    Function *TheFunction = getFunction(P.getName());
+    setPrototype(std::move(Proto));
+    Function *TheFunction = getFunction(P.getSymbol());
     if (!TheFunction)
         return nullptr;
 
+    // the module may have declared it from an earlier prototype, which took
+    // other arguments
+    if (TheFunction->arg_size() !=
+        P.getArgs().size() + std::count(P.getBuffers().begin(),
+                                        P.getBuffers().end(), true)) {
+        LogErrorV("Definition doesn't match the earlier prototype's arguments");
+        return nullptr;
+    }
+
     // if this is an operator, install it
     if (P.isBinaryOp())
-        BinopPrecedence[P.getOperatorName()] = P.getBinaryPrecedence();
+        State->BinopPrecedence[(unsigned char)P.getOperatorName()] = P.getBinaryPrecedence();
 
     // create a new basic block to start insertion into
-    BasicBlock *BB = BasicBlock::Create(TheContext, "entry", TheFunction);
-    Builder.SetInsertPoint(BB);
+    BasicBlock *BB =
+        BasicBlock::Create(*State->TheContext, "entry", TheFunction);
+    setInsertBlock(BB);
+    State->CodegenMemo.resize(State->AST.size());
+
+    // record the function arguments in the NamedValues table, dropping
+    // anything left bound by a function whose codegen failed part way
+    popBindings(0);
+    State->UnsealedPhis.clear();
+    State->NamedValues.resize(State->SymbolNames.size());
+    auto ArgIt = TheFunction->arg_begin();
+    for (unsigned Idx = 0, e = P.getArgs().size(); Idx != e; ++Idx){
+        Argument &Arg = *ArgIt++;
+        SymbolId ArgName = P.getArgs()[Idx];
+
+        // a buffer is bound to its pointer, which its length follows
+        if (P.isBuffer(Idx)) {
+            ++ArgIt;
+            pushBinding(ArgName, &Arg);
+            continue;
+        }
+
+        // with direct SSA the argument is the variable's first value
+        if (State->Options.DirectSSA) {
+            pushBinding(ArgName, &Arg);
+            continue;
+        }
 
-    // record the function argument in the NamedValue map
-    NamedValues.clear();
-    for (auto &Arg : TheFunction->args()){
         // create an alloca for this variable
-        AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, Arg.getName());
+        AllocaInst *Alloca =
+            CreateEntryBlockAlloca(TheFunction, symbolName(ArgName));
 
         // Store the initial value into the alloca
-        Builder.CreateStore(&Arg, Alloca);
+        State->Builder->CreateStore(&Arg, Alloca);
 
         // add arguments to variable symbol table
-        NamedValues[Arg.getName()] = Alloca;
+        pushBinding(ArgName, Alloca);
     }
-    if (Value *RetVal = Body->codegen()){
+    Value *RetVal;
+    {
+        TimeRegion T(phaseTimer(CodegenTimer));
+        IRBuilderBase::FastMathFlagGuard MathFlagsGuard(*State->Builder);
+        State->Builder->setFastMathFlags(MathFlags ? *MathFlags
+                                                   : sessionMathFlags());
+        RetVal = codegenExpr(Body);
+    }
+    if (RetVal){
         // finish off the function
-        Builder.CreateRet(RetVal);
+        State->Builder->CreateRet(RetVal);
 
         // validate the generated code, chekcing for consistency
         verifyFunction(*TheFunction);
+        State->NumIRInsts += TheFunction->getInstructionCount();
 
         // optimize the function
-        TheFPM->run(*TheFunction);
+        if (Optimize && State->TheFPM) {
+            TimeRegion T(phaseTimer(OptTimer));
+            State->TheFPM->run(*TheFunction);
+        }
 
         return TheFunction;
     }
 
-    // error reading body, remove function
-    TheFunction->eraseFromParent();
+    // error reading body, remove function. Other definitions in the module
+    // may call it, in which case it goes back to being a declaration.
+    if (TheFunction->use_empty())
+        TheFunction->eraseFromParent();
+    else
+        TheFunction->deleteBody();
     return nullptr;
 }
 
+// Optimization runs on the new pass manager. By default each function gets
+// a few function passes as soon as it is generated, which is all a REPL can
+// afford. -O1 to -O3, or an explicit -passes pipeline, instead run a module
+// pipeline over each module just before the JIT compiles it, once the
+// module is complete, so that interprocedural passes such as the inliner
+// see every definition in it. -O0 runs nothing at all.
+
+// modulePipeline - the module pipeline -O or -passes asked for, if any
+static std::string modulePipeline(const CompilerOptions &Options) {
+    if (!Options.PassPipeline.empty())
+        return Options.PassPipeline;
+    if (Options.OptLevel > 0)
+        return "default<O" + std::to_string(Options.OptLevel) + ">";
+    return "";
+}
+
+// usesModulePipeline - whether functions are left for the module pipeline
+static bool usesModulePipeline(const CompilerOptions &Options) {
+    return Options.OptLevel >= 0 || !Options.PassPipeline.empty();
+}
+
+// splitPipeline - the top-level elements of a pipeline, with the passes of
+// a function(...) element split into an element each, which runs them the
+// same
+static void splitPipeline(StringRef Text,
+                          SmallVectorImpl<std::string> &Elements) {
+    unsigned Depth = 0;
+    size_t Start = 0;
+    for (size_t I = 0; I <= Text.size(); ++I) {
+        if (I < Text.size() && (Text[I] == '(' || Text[I] == '<'))
+            ++Depth;
+        else if (I < Text.size() && (Text[I] == ')' || Text[I] == '>'))
+            --Depth;
+        else if (I == Text.size() || (Text[I] == ',' && Depth == 0)) {
+            StringRef Element = Text.slice(Start, I).trim();
+            Start = I + 1;
+            SmallVector<std::string, 8> Inner;
+            if (Element.startswith("function(") && Element.endswith(")"))
+                splitPipeline(Element.drop_front(9).drop_back(), Inner);
+            if (Inner.size() > 1)
+                for (auto &Pass : Inner)
+                    Elements.push_back("function(" + Pass + ")");
+            else if (!Element.empty())
+                Elements.push_back(Element.str());
+        }
+    }
+}
+
+// runPipeline - run pass pipeline Text over M. The new pass manager in this
+// LLVM has no hooks to time the passes inside a pipeline with, so with
+// -time-passes each element of the pipeline is run and timed separately.
+static void runPipeline(Module &M, TargetMachine *TM, StringRef Text) {
+    if (Text.empty())
+        return;
+    PassBuilder PB(TM);
+    AnalysisManagers AM(PB);
+    SmallVector<std::string, 8> Elements;
+    if (passTimer(Text))
+        splitPipeline(Text, Elements);
+    else
+        Elements.push_back(Text.str());
+
+    for (auto &Element : Elements) {
+        ModulePassManager MPM;
+        cantFail(PB.parsePassPipeline(MPM, Element, /*VerifyEachPass=*/false));
+        TimeRegion T(passTimer(Element));
+        MPM.run(M, AM.MAM);
+    }
+}
+
+// checkPipelineOptions - report an -O or -passes that can't be run
+static bool checkPipelineOptions(const CompilerOptions &Options) {
+    if (Options.OptLevel < -1 || Options.OptLevel > 3) {
+        errs() << "Invalid optimization level -O" << Options.OptLevel << "\n";
+        return false;
+    }
+    if (modulePipeline(Options).empty())
+        return true;
+    PassBuilder PB;
+    ModulePassManager MPM;
+    if (auto Err = PB.parsePassPipeline(MPM, modulePipeline(Options),
+                                        /*VerifyEachPass=*/false)) {
+        errs() << "Invalid -passes: " << toString(std::move(Err)) << "\n";
+        return false;
+    }
+    return true;
+}
+
 void InitializeModuleAndPassManager(){
     // open a new module
-    TheModule = llvm::make_unique<Module>("my cool jit", TheContext);
-    TheModule->setDataLayout(TheJIT->getTargetMachine().createDataLayout());
+    State->TheModule =
+        llvm::make_unique<Module>("my cool jit", *State->TheContext);
+    State->TheModule->setDataLayout(
+        State->TheJIT->getTargetMachine().createDataLayout());
+
+    // the function passes, unless the module pipeline will optimize it
+    if (usesModulePipeline(State->Options))
+        State->TheFPM.reset();
+    else
+        State->TheFPM = llvm::make_unique<FunctionOptimizer>(
+            State->TheTargetMachine, State->Options);
+}
+
+// Each definition is handed to the JIT in a module of its own (or of its
+// batch), so on its own the module pipeline can't inline a small function
+// into callers that come later. So when compiling eagerly with a module
+// pipeline, the IR of each small function is kept as it is handed over, and
+// a module about to be optimized gets an internal copy of each one it calls.
+// The copy is inlined, or else called directly, with the fast calling
+// convention, instead of through the JIT's symbol resolution, and being
+// internal, interprocedural constant propagation can specialize it for the
+// arguments it is called with.
+//
+// A caller calls whichever definition of a function the JIT resolved it to,
+// and not necessarily the latest, so a copy is only made while nothing the
+// function calls has been redefined since it was kept.
+
+// importsDefinitions - whether functions are copied into their callers
+static bool importsDefinitions() {
+    const CompilerOptions &Options = State->Options;
+    return Options.ImportSize && usesModulePipeline(Options) &&
+           !Options.LazyCompile && !Options.Tiered;
+}
+
+// ImportableBody - a function defined in a module handed to the JIT, with
+// the functions it calls
+struct ImportableBody {
+    std::string Name;
+    std::string Bitcode; // empty if it is too big to copy
+    std::vector<std::string> Callees;
+};
+
+// collectImports - the functions M defines, with the IR of those small
+// enough to copy, as bitcode so that any context can read it
+static std::vector<ImportableBody> collectImports(Module &M) {
+    std::vector<ImportableBody> Bodies;
+    if (!importsDefinitions())
+        return Bodies;
+    for (auto &F : M) {
+        if (F.isDeclaration())
+            continue;
+        Bodies.emplace_back();
+        ImportableBody &B = Bodies.back();
+        B.Name = F.getName().str();
+        unsigned Size = 0;
+        for (auto &BB : F)
+            Size += BB.size();
+        if (Size > State->Options.ImportSize)
+            continue;
+
+        for (auto &BB : F)
+            for (auto &I : BB)
+                if (auto *Call = dyn_cast<CallInst>(&I))
+                    if (auto *Callee = Call->getCalledFunction())
+                        B.Callees.push_back(Callee->getName().str());
+        ValueToValueMapTy VMap;
+        auto Copy = CloneModule(
+            M, VMap, [&](const GlobalValue *GV) { return GV == &F; });
+        raw_string_ostream OS(B.Bitcode);
+        WriteBitcodeToFile(*Copy, OS);
+        OS.flush();
+    }
+    return Bodies;
+}
+
+// ImportStore - the functions that have been handed to the JIT, as
+// collectImports found them, and how many times each name was defined
+class ImportStore {
+    struct Entry {
+        std::string Bitcode;
+        std::vector<std::pair<std::string, unsigned>> Callees;
+    };
+    StringMap<Entry> Entries;
+    StringMap<unsigned> Definitions;
+
+    // isCurrent - whether nothing E calls has been redefined since
+    bool isCurrent(const Entry &E) const {
+        for (auto &Callee : E.Callees)
+            if (Definitions.lookup(Callee.first) != Callee.second)
+                return false;
+        return true;
+    }
+
+    // importBody - give declaration D the body of E, or return false
+    bool importBody(Function &D, const Entry &E,
+                    std::vector<Function *> &Declarations) {
+        Module &M = *D.getParent();
+        auto Src = parseBitcodeFile(MemoryBufferRef(E.Bitcode, D.getName()),
+                                    M.getContext());
+        if (!Src) {
+            consumeError(Src.takeError());
+            return false;
+        }
+        Function *SF = (*Src)->getFunction(D.getName());
+        if (!SF || SF->getFunctionType() != D.getFunctionType() ||
+            !(*Src)->global_empty())
+            return false;
+
+        // map what the body calls to M's declarations of it
+        ValueToValueMapTy VMap;
+        VMap[SF] = &D;
+        for (auto &G : **Src) {
+            if (&G == SF)
+                continue;
+            Function *F = M.getFunction(G.getName());
+            if (!F) {
+                F = Function::Create(G.getFunctionType(),
+                                     Function::ExternalLinkage, G.getName(),
+                                     &M);
+                Declarations.push_back(F);
+            } else if (F->getFunctionType() != G.getFunctionType())
+                return false;
+            VMap[&G] = F;
+        }
+        auto Arg = D.arg_begin();
+        for (auto &A : SF->args()) {
+            Arg->setName(A.getName());
+            VMap[&A] = &*Arg++;
+        }
+
+        SmallVector<ReturnInst *, 4> Returns;
+        CloneFunctionInto(&D, SF, VMap, /*ModuleLevelChanges=*/true, Returns);
+        D.setLinkage(GlobalValue::InternalLinkage);
+        return true;
+    }
+
+public:
+    unsigned NumImported = 0;
+
+    // commit - record functions handed to the JIT, in the order it got them
+    void commit(std::vector<ImportableBody> Bodies) {
+        for (auto &B : Bodies)
+            ++Definitions[B.Name];
+        for (auto &B : Bodies) {
+            Entry &E = Entries[B.Name];
+            E.Bitcode = std::move(B.Bitcode);
+            E.Callees.clear();
+            for (auto &Callee : B.Callees)
+                E.Callees.push_back(
+                    std::make_pair(Callee, Definitions.lookup(Callee)));
+        }
+    }
+
+    // import - copy the functions M calls, and those they call in turn, into
+    // M where they are small enough and current
+    void import(Module &M) {
+        std::vector<Function *> Declarations, Imported;
+        for (auto &F : M)
+            if (F.isDeclaration() && !F.use_empty())
+                Declarations.push_back(&F);
+        while (!Declarations.empty()) {
+            Function *D = Declarations.back();
+            Declarations.pop_back();
+            auto I = Entries.find(D->getName());
+            if (I == Entries.end() || I->second.Bitcode.empty() ||
+                !isCurrent(I->second))
+                continue;
+            if (importBody(*D, I->second, Declarations))
+                Imported.push_back(D);
+        }
+        NumImported += Imported.size();
+
+        // nothing outside M can call the copies, so once every call to them
+        // is in place they can use the fast calling convention
+        for (Function *F : Imported) {
+            bool OnlyCalled = all_of(F->users(), [&](User *U) {
+                auto *Call = dyn_cast<CallInst>(U);
+                return Call && Call->getCalledFunction() == F;
+            });
+            if (!OnlyCalled)
+                continue;
+            F->setCallingConv(CallingConv::Fast);
+            for (User *U : F->users())
+                cast<CallInst>(U)->setCallingConv(CallingConv::Fast);
+        }
+    }
+};
+
+// runModulePipeline - run the module pipeline, if there is one, over a
+// module generated for it, before it is compiled. The -jobs workers, whose
+// ImportStore is empty, copy nothing into their modules, as definitions the
+// main thread hasn't reached yet may come between theirs and their callers'.
+static void runModulePipeline(Module &M) {
+    if (!usesModulePipeline(State->Options))
+        return;
+    TimeRegion T(phaseTimer(OptTimer));
+    if (importsDefinitions())
+        State->TheImports->import(M);
+    runPipeline(M, State->TheTargetMachine, modulePipeline(State->Options));
+}
+
+// optimizeModule - optimize a module generated without optimization, when
+// the lazy JIT is about to compile it
+static void optimizeModule(Module &M, TargetMachine &TM,
+                           const CompilerOptions &Options) {
+    TimeRegion T(phaseTimer(OptTimer));
+    if (usesModulePipeline(Options)) {
+        runPipeline(M, &TM, modulePipeline(Options));
+        return;
+    }
+    FunctionOptimizer FPM(&TM, Options);
+    for (auto &F : M)
+        if (!F.isDeclaration())
+            FPM.run(F);
+}
+
+// optimizeQuick - the first tier's optimization: only what codegen relies on
+// having been done
+static void optimizeQuick(Module &M, TargetMachine &TM,
+                          const CompilerOptions &Options) {
+    if (Options.DirectSSA)
+        return;
+    TimeRegion T(phaseTimer(OptTimer));
+    runPipeline(M, &TM, "function(mem2reg)");
+}
 
-    // create a new pass manager attached to it
-    TheFPM = llvm::make_unique<legacy::FunctionPassManager>(TheModule.get());
-    // Promote allocas to registers
-    TheFPM->add(llvm::createPromoteMemoryToRegisterPass());
-    // do simple 'peephole' optimizations and bit-twiddling optimizations
-    TheFPM->add(llvm::createInstructionCombiningPass());
-    // reassociate expressions
-    TheFPM->add(llvm::createReassociatePass());
-    // eliminate common subexpressions
-    TheFPM->add(llvm::createNewGVNPass());
-    // simplify the control flow graph (delete unreachable block, etc.)
-    TheFPM->add(llvm::createCFGSimplificationPass());
+// optimizeHot - the full -O3 pipeline, for functions the tiered JIT found hot
+static void optimizeHot(Module &M, TargetMachine &TM) {
+    TimeRegion T(phaseTimer(HotOptTimer));
+    runPipeline(M, &TM, "default<O3>");
+}
+
+// emitsDefinitions - whether output.o gets every definition compiled. The
+// modules handed to the JIT are gone by the time output.o is written, and
+// are optimized for the JIT's target, so each is kept, as bitcode, as it was
+// generated.
+static bool emitsDefinitions() {
+    return State->Options.EmitDefinitions ||
+           !State->Options.Multiversion.empty();
+}
 
-    TheFPM->doInitialization();
+// definitionBitcode - M as bitcode, or nothing if output.o doesn't need it
+static std::string definitionBitcode(Module &M) {
+    std::string Bitcode;
+    if (!emitsDefinitions())
+        return Bitcode;
+    raw_string_ostream OS(Bitcode);
+    WriteBitcodeToFile(M, OS);
+    OS.flush();
+    return Bitcode;
+}
+
+// addDefinitions - hand a module of definitions to the JIT, to be compiled
+// now or on first call depending on the mode
+static void addDefinitions(std::unique_ptr<Module> M) {
+    if (emitsDefinitions())
+        State->ObjectDefinitions.push_back(definitionBitcode(*M));
+    // the optimizers run where the JIT compiles, which may be another
+    // thread, so they get the session's options rather than State
+    const CompilerOptions *Options = &State->Options;
+    if (Options->Tiered)
+        State->TheJIT->addLazyModule(
+            std::move(M), [Options](Module &M, TargetMachine &TM) {
+                optimizeQuick(M, TM, *Options);
+            });
+    else if (Options->LazyCompile)
+        State->TheJIT->addLazyModule(
+            std::move(M), [Options](Module &M, TargetMachine &TM) {
+                optimizeModule(M, TM, *Options);
+            });
+    else {
+        State->TheImports->commit(collectImports(*M));
+        runModulePipeline(*M);
+        State->TheJIT->addModule(std::move(M));
+    }
+}
+
+// flushDefinitions - hand the definitions accumulated in TheModule to the JIT
+// and start a new module for the next ones. When compiling a file they are
+// batched, so that the cost of a module, its pass manager and the JIT's
+// memory manager for it, is paid once per batch rather than once per
+// function.
+static void flushDefinitions() {
+    if (!State->NumPendingDefinitions)
+        return;
+    addDefinitions(std::move(State->TheModule));
+    InitializeModuleAndPassManager();
+    State->NumPendingDefinitions = 0;
+}
+
+// generateDefinition - generate a parsed definition into TheModule and print
+// it, optimized unless that is left until the JIT compiles it
+static Function *generateDefinition(FunctionAST &FnAST) {
+    auto *FnIR =
+        FnAST.codegen(!State->Options.LazyCompile && !State->Options.Tiered);
+    if (FnIR) {
+        diags() << "Read function definition: ";
+        FnIR->print(diags());
+        diags() << "\n";
+    }
+    return FnIR;
 }
 
 static void HandleDefinition() {
     if (auto FnAST = ParseDefinition()) {
-        if (auto *FnIR = FnAST->codegen()){
-            fprintf(stderr, "Read function definition: ");
-            FnIR->print(errs());
-            fprintf(stderr, "\n");
-            TheJIT->addModule(std::move(TheModule));
-            InitializeModuleAndPassManager();
+        FnAST->simplify();
+
+        // a function redefined within a batch replaces the earlier
+        // definition, which has to be in the JIT by itself by then
+        if (auto *F = State->TheModule->getFunction(FnAST->getName()))
+            if (!F->isDeclaration())
+                flushDefinitions();
+
+        if (generateDefinition(*FnAST)) {
+            // the REPL compiles each definition as it is entered
+            unsigned Limit = State->Source->isInteractive()
+                                 ? 1u
+                                 : State->Options.BatchSize;
+            if (++State->NumPendingDefinitions >= Limit)
+                flushDefinitions();
         }
     } else {
         // Skip token for error recovery.
         getNextToken();
     }
+
+    // the function's expression nodes are no longer needed
+    ResetAST();
 }
 
 static void HandleExtern() {
@@ -1096,7 +3148,7 @@ static void HandleExtern() {
             fprintf(stderr, "Read extern: ");
             FnIR->print(errs());
             fprintf(stderr, "\n");
-            FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
+            setPrototype(std::move(ProtoAST));
         }
     } else {
         // Skip token for error recovery.
@@ -1104,6 +3156,895 @@ static void HandleExtern() {
     }
 }
 
+//===----------------------------------------------------------------------===//
+// Parallel front end
+//===----------------------------------------------------------------------===//
+
+// With -jobs, the definitions in a file are parsed, generated and optimized
+// on worker threads, and unless they are compiled lazily, compiled to object
+// code there too. A pre-pass splits the file into its definitions and
+// externs, and groups runs of consecutive definitions into units of up to
+// -batch-size. Each worker has its own lexer, tables and LLVMContext, so
+// nothing is shared while a unit is compiled.
+//
+// MainLoop still walks the whole file in order and handles the externs and
+// top-level expressions itself. When it reaches a unit it waits for it,
+// prints what the worker printed and hands the unit to the JIT, so the
+// output is that of a sequential run whatever the number of threads. A unit
+// is compiled assuming that everything before it goes the way the pre-pass
+// predicted; as soon as something doesn't (a definition that fails to parse
+// or generate, error recovery swallowing an item), the rest of the file is
+// handled sequentially, reporting errors just as it would without -jobs.
+
+// FrontEndStats - the -toy-stats counters a worker accumulated for a unit
+struct FrontEndStats {
+    size_t PeakASTNodes, PeakASTBytes;
+    uint64_t NumParsedNodes, NumSharedNodes, NumFolded, NumMemoHits, NumIRInsts;
+};
+
+// takeStats - this thread's counters, which start again from zero
+static FrontEndStats takeStats() {
+    CompilerState &C = *State;
+    FrontEndStats S = {C.PeakASTNodes, C.PeakASTBytes, C.NumParsedNodes,
+                       C.NumSharedNodes, C.NumFolded, C.NumMemoHits, C.NumIRInsts};
+    C.PeakASTNodes = C.PeakASTBytes = 0;
+    C.NumParsedNodes = C.NumSharedNodes = C.NumFolded = C.NumMemoHits =
+        C.NumIRInsts = 0;
+    return S;
+}
+
+static void addStats(const FrontEndStats &S) {
+    State->PeakASTNodes = std::max(State->PeakASTNodes, S.PeakASTNodes);
+    State->PeakASTBytes = std::max(State->PeakASTBytes, S.PeakASTBytes);
+    State->NumParsedNodes += S.NumParsedNodes;
+    State->NumSharedNodes += S.NumSharedNodes;
+    State->NumFolded += S.NumFolded;
+    State->NumMemoHits += S.NumMemoHits;
+    State->NumIRInsts += S.NumIRInsts;
+}
+
+// PipelineItem - a definition or extern found by the pre-pass, and its
+// prototype if that parsed. Names are copies, since symbols are per thread.
+struct PipelineItem {
+    bool IsDef;
+    const char *Begin; // its first token
+    const char *End;   // for a definition, the token after its body
+    bool HasProto = false;
+    std::string Name;
+    std::vector<std::string> Args;
+    std::vector<bool> Buffers;
+    bool IsOperator = false;
+    unsigned Precedence = 0;
+};
+
+// PipelineUnit - consecutive definitions compiled together by one worker,
+// and once Done, what came of them
+struct PipelineUnit {
+    unsigned FirstItem, NumItems;
+    bool Done = false, Failed = false;
+    std::string Output;
+    std::unique_ptr<LLVMContext> Context;
+    std::unique_ptr<Module> M;            // when compiling lazily
+    std::unique_ptr<MemoryBuffer> Object; // otherwise
+    std::vector<ImportableBody> Imports;  // for the main thread's ImportStore
+    std::string Definitions;              // for output.o, if it wants them
+    FrontEndStats Stats;
+};
+
+class Pipeline {
+    std::vector<PipelineItem> Items;
+    std::vector<PipelineUnit> Units;
+    int StandardPrecedence[256];
+    std::vector<std::unique_ptr<TargetMachine>> TMs;
+    KaleidoscopeJIT *JIT = State->TheJIT; // the session's, for its data layout
+    CompilerOptions Options = State->Options; // the session's, for the workers
+    std::vector<std::thread> Workers;
+    std::atomic<unsigned> NextUnit{0};
+    std::atomic<bool> Abandoned{false};
+    std::mutex Mutex;
+    std::condition_variable UnitDone;
+    // the main thread's position: the item MainLoop should reach next, and
+    // the unit it should take next
+    unsigned MainItem = 0, MainUnit = 0;
+
+    void work(TargetMachine *TM);
+    void compileUnit(PipelineUnit &U, TargetMachine *TM);
+    void registerItem(const PipelineItem &I);
+
+public:
+    ~Pipeline() { abandon(); }
+
+    void scan();
+    void start(unsigned NumThreads);
+    bool takeUnit();
+    void reachExtern();
+
+    // abandon - handle the rest of the file sequentially
+    void abandon() {
+        Abandoned = true;
+        for (auto &Worker : Workers)
+            Worker.join();
+        Workers.clear();
+    }
+};
+
+// scan - the pre-pass, run on the main thread before MainLoop. The lexer is
+// context free, so the items are found at the same places MainLoop will
+// find them, and their prototypes parse the same way.
+void Pipeline::scan() {
+    std::copy(std::begin(State->BinopPrecedence),
+              std::end(State->BinopPrecedence), StandardPrecedence);
+
+    // prototype errors are reported when the item is handled for real
+    Diagnostics = &nulls();
+    const char *Start = State->Source->CurPtr;
+    DenseSet<SymbolId> UnitNames;
+    bool Gap = true; // whether the next definition can't join the last unit
+    getNextToken();
+    while (State->CurTok != tok_eof) {
+        if (State->CurTok != tok_def && State->CurTok != tok_extern) {
+            Gap |= State->CurTok != ';';
+            getNextToken();
+            continue;
+        }
+
+        PipelineItem I;
+        I.IsDef = State->CurTok == tok_def;
+        I.Begin = State->Source->TokStart;
+        getNextToken();
+        SymbolId Name = NoSymbol;
+        if (auto Proto = ParsePrototype()) {
+            Name = Proto->getSymbol();
+            I.HasProto = true;
+            I.Name = Proto->getName().str();
+            for (SymbolId Arg : Proto->getArgs())
+                I.Args.push_back(symbolName(Arg).str());
+            I.Buffers = Proto->getBuffers();
+            I.IsOperator = Proto->isUnaryOp() || Proto->isBinaryOp();
+            I.Precedence = Proto->getBinaryPrecedence();
+        }
+
+        if (I.IsDef) {
+            // the body can't contain any of these
+            while (State->CurTok != tok_eof && State->CurTok != ';' &&
+                   State->CurTok != tok_def && State->CurTok != tok_extern)
+                getNextToken();
+            I.End = State->Source->TokStart;
+
+            // a redefinition has to be in the JIT by itself before the
+            // definition it replaces, just as in a batch
+            if (Gap || Units.back().NumItems >= State->Options.BatchSize ||
+                UnitNames.count(Name)) {
+                Units.emplace_back();
+                Units.back().FirstItem = Items.size();
+                Units.back().NumItems = 0;
+                UnitNames.clear();
+            }
+            ++Units.back().NumItems;
+            if (Name != NoSymbol)
+                UnitNames.insert(Name);
+            Gap = false;
+        } else {
+            Gap = true;
+        }
+        Items.push_back(std::move(I));
+    }
+
+    State->Source->CurPtr = Start;
+    Diagnostics = nullptr;
+}
+
+// start - compile the units on NumThreads workers, each with its own
+// TargetMachine if it compiles to object code
+void Pipeline::start(unsigned NumThreads) {
+    for (unsigned I = 0; I != NumThreads; ++I) {
+        TargetMachine *TM = nullptr;
+        if (!State->Options.LazyCompile && !State->Options.Tiered) {
+            TMs.emplace_back(JIT->createTargetMachine());
+            TM = TMs.back().get();
+        }
+        Workers.emplace_back([this, TM] { work(TM); });
+    }
+}
+
+// registerItem - record an item's prototype as handling it would have, on
+// the assumption that it went well
+void Pipeline::registerItem(const PipelineItem &I) {
+    if (!I.HasProto)
+        return;
+    std::vector<SymbolId> Args;
+    for (auto &Arg : I.Args)
+        Args.push_back(intern(Arg));
+    auto Proto = llvm::make_unique<PrototypeAST>(intern(I.Name), std::move(Args),
+                                                 I.IsOperator, I.Precedence,
+                                                 I.Buffers);
+    if (I.IsDef && Proto->isBinaryOp())
+        State->BinopPrecedence[(unsigned char)Proto->getOperatorName()] =
+            Proto->getBinaryPrecedence();
+    setPrototype(std::move(Proto));
+}
+
+// work - a worker thread. Units are taken in order, so whenever the main
+// thread waits for a unit some worker already has it.
+void Pipeline::work(TargetMachine *TM) {
+    // the worker's own tables, for as long as it runs
+    CompilerState WorkerState;
+    WorkerState.Options = Options;
+    State = &WorkerState;
+    State->TheJIT = JIT;
+    State->TheTargetMachine = TM;
+    std::copy(std::begin(StandardPrecedence), std::end(StandardPrecedence),
+              State->BinopPrecedence);
+    unsigned Registered = 0;
+    while (!Abandoned) {
+        unsigned Idx = NextUnit++;
+        if (Idx >= Units.size())
+            return;
+        PipelineUnit &U = Units[Idx];
+
+        // catch up with the prototypes and operators declared before U
+        for (; Registered != U.FirstItem; ++Registered)
+            registerItem(Items[Registered]);
+        compileUnit(U, TM);
+        Registered = U.FirstItem + U.NumItems;
+
+        // nothing after a failed unit will be used
+        if (U.Failed)
+            Abandoned = true;
+        {
+            std::lock_guard<std::mutex> Lock(Mutex);
+            U.Done = true;
+        }
+        UnitDone.notify_all();
+    }
+}
+
+// compileUnit - parse, generate and optimize U's definitions into a module
+// of its own, in a context of its own
+void Pipeline::compileUnit(PipelineUnit &U, TargetMachine *TM) {
+    raw_string_ostream OS(U.Output);
+    Diagnostics = &OS;
+    SourceBuffer UnitSource;
+    State->Source = &UnitSource;
+    U.Context = llvm::make_unique<LLVMContext>();
+    setUpContext(*U.Context, State->Options);
+    IRBuilder<> UnitBuilder(*U.Context);
+    State->TheContext = U.Context.get();
+    State->Builder = &UnitBuilder;
+    InitializeModuleAndPassManager();
+
+    unsigned EndItem = U.FirstItem + U.NumItems;
+    State->Source->CurPtr = Items[U.FirstItem].Begin;
+    State->Source->BufEnd = Items[EndItem - 1].End;
+    getNextToken();
+    bool Failed = false;
+    for (unsigned I = U.FirstItem; I != EndItem && !Failed; ++I) {
+        // each definition has to be exactly where the pre-pass found it
+        std::unique_ptr<FunctionAST> FnAST;
+        if (State->CurTok == tok_def &&
+            State->Source->TokStart == Items[I].Begin)
+            FnAST = ParseDefinition();
+        Failed = !FnAST || State->Source->TokStart != Items[I].End;
+        if (!Failed) {
+            FnAST->simplify();
+            Failed = !generateDefinition(*FnAST);
+        }
+        ResetAST();
+        while (State->CurTok == ';')
+            getNextToken();
+    }
+
+    State->TheFPM.reset();
+    if (!Failed) {
+        if (State->Options.LazyCompile || State->Options.Tiered)
+            U.M = std::move(State->TheModule);
+        else {
+            U.Imports = collectImports(*State->TheModule);
+            U.Definitions = definitionBitcode(*State->TheModule);
+            runModulePipeline(*State->TheModule);
+            auto *Cache = State->TheJIT->getObjectCache();
+            U.Object = SimpleCompiler(*TM, Cache)(*State->TheModule);
+        }
+    }
+    State->TheModule.reset();
+    if (!U.M)
+        U.Context.reset();
+    State->TheContext = nullptr;
+    State->Builder = nullptr;
+    State->Source = nullptr;
+    OS.flush();
+    Diagnostics = nullptr;
+    U.Failed = Failed;
+    U.Stats = takeStats();
+}
+
+// takeUnit - called by MainLoop at a def. Takes the unit starting there,
+// returning false if the definition has to be handled sequentially.
+bool Pipeline::takeUnit() {
+    if (Abandoned && Workers.empty())
+        return false;
+    if (MainItem == Items.size() || !Items[MainItem].IsDef ||
+        Items[MainItem].Begin != State->Source->TokStart) {
+        abandon();
+        return false;
+    }
+
+    PipelineUnit &U = Units[MainUnit];
+    assert(U.FirstItem == MainItem && "units are taken whole");
+    {
+        std::unique_lock<std::mutex> Lock(Mutex);
+        UnitDone.wait(Lock, [&] { return U.Done; });
+    }
+    if (U.Failed) {
+        abandon();
+        return false;
+    }
+
+    errs() << U.Output;
+    addStats(U.Stats);
+    for (unsigned I = U.FirstItem; I != U.FirstItem + U.NumItems; ++I)
+        registerItem(Items[I]);
+    if (U.Object) {
+        State->TheImports->commit(std::move(U.Imports));
+        if (emitsDefinitions())
+            State->ObjectDefinitions.push_back(std::move(U.Definitions));
+        State->TheJIT->addObject(std::move(U.Object));
+    } else {
+        addDefinitions(std::move(U.M));
+        State->WorkerContexts.push_back(std::move(U.Context));
+    }
+    ++State->NumPipelinedUnits;
+
+    // carry on after the unit's last definition
+    MainItem += U.NumItems;
+    ++MainUnit;
+    State->Source->CurPtr = Items[MainItem - 1].End;
+    getNextToken();
+    return true;
+}
+
+// reachExtern - called by MainLoop at an extern, which it handles itself
+void Pipeline::reachExtern() {
+    if (Abandoned && Workers.empty())
+        return;
+    if (MainItem != Items.size() && !Items[MainItem].IsDef &&
+        Items[MainItem].Begin == State->Source->TokStart)
+        ++MainItem;
+    else
+        abandon();
+}
+
+//===----------------------------------------------------------------------===//
+// Bytecode interpreter
+//===----------------------------------------------------------------------===//
+
+// A top-level expression runs exactly once, so generating, optimizing and
+// linking machine code for it costs far more than it saves. Unless it has a
+// loop, it is compiled to a small register based bytecode instead and
+// interpreted, calling into the JIT for the functions it uses.
+
+// Opcode - a bytecode instruction. Every register holds a double.
+enum Opcode : uint8_t {
+    Op_Move,      // R[Dst] = R[A]
+    Op_Add,       // R[Dst] = R[A] + R[B]
+    Op_Sub,       // R[Dst] = R[A] - R[B]
+    Op_Mul,       // R[Dst] = R[A] * R[B]
+    Op_Less,      // R[Dst] = R[A] < R[B] or unordered ? 1 : 0, like fcmp ult
+    Op_Jump,      // continue at instruction A
+    Op_JumpIfNot, // continue at instruction B unless R[A] is nonzero and not
+                  // NaN, like fcmp one with 0
+    Op_Call,      // R[Dst] = Callees[A] called with the registers listed at
+                  // CallArgs[B]
+    Op_Return,    // return R[A]
+};
+
+struct Instr {
+    Opcode Op;
+    uint32_t Dst, A, B;
+};
+
+// BytecodeCallee - a function bytecode calls, looked up in the JIT when the
+// expression is compiled
+struct BytecodeCallee {
+    JITTargetAddress Address;
+    unsigned NumArgs;
+};
+
+// NoReg - no register, for what the bytecode compiler leaves to the JIT
+static const uint32_t NoReg = ~0u;
+
+// MaxBytecodeArgs - calls with more arguments than this are left to the JIT,
+// since the interpreter needs a function type for each arity it calls
+static const unsigned MaxBytecodeArgs = 6;
+
+namespace {
+// Bytecode - the bytecode of one top-level expression, its compiler and its
+// interpreter. Registers are allocated fresh for every value, so a register
+// is written by exactly one instruction apart from the variables' own, and
+// numbers get a register each that is loaded before the first instruction
+// runs. Like codegen, compilation walks operators and call arguments with an
+// explicit stack and only recurses into if and var; interpreting never
+// recurses.
+class Bytecode {
+    std::vector<Instr> Code;
+    std::vector<std::pair<uint32_t, double>> Constants;
+    std::vector<BytecodeCallee> Callees;
+    std::vector<uint32_t> CallArgs;
+    std::vector<double> Registers;
+    uint32_t NumRegs = 0;
+
+    // ConstantRegs - the register of each number, keyed on its bits
+    DenseMap<uint64_t, uint32_t> ConstantRegs;
+    // VarRegs/Scopes - the register each variable in scope lives in, indexed
+    // by SymbolId, and the bindings var shadowed, as for NamedValues
+    std::vector<uint32_t> VarRegs;
+    std::vector<std::pair<SymbolId, uint32_t>> Scopes;
+    // Epoch/Memo - as CodegenEpoch and CodegenMemo, the register holding
+    // each shared pure node's value while it is still valid
+    uint64_t Epoch = 0;
+    std::vector<std::pair<uint32_t, uint64_t>> Memo;
+
+    uint32_t newRegister() { return NumRegs++; }
+
+    uint32_t emit(Opcode Op, uint32_t Dst, uint32_t A = 0, uint32_t B = 0) {
+        Code.push_back({Op, Dst, A, B});
+        return Code.size() - 1;
+    }
+
+    // bind/unbind - as pushBinding and popBindings
+    void bind(SymbolId Sym, uint32_t Reg) {
+        ++Epoch;
+        Scopes.push_back(std::make_pair(Sym, VarRegs[Sym]));
+        VarRegs[Sym] = Reg;
+    }
+    void unbind(size_t Mark) {
+        ++Epoch;
+        while (Scopes.size() > Mark) {
+            VarRegs[Scopes.back().first] = Scopes.back().second;
+            Scopes.pop_back();
+        }
+    }
+
+    uint32_t compileNumber(double Val) {
+        uint64_t Bits;
+        std::memcpy(&Bits, &Val, sizeof(double));
+        auto R = ConstantRegs.insert(std::make_pair(Bits, NumRegs));
+        if (R.second) {
+            Constants.push_back(std::make_pair(NumRegs, Val));
+            newRegister();
+        }
+        return R.first->second;
+    }
+
+    // compileCall - call the function named Sym, if the JIT has it and it
+    // takes Args
+    uint32_t compileCall(SymbolId Sym, ArrayRef<uint32_t> Args) {
+        auto &Protos = State->FunctionProtos;
+        if (Sym >= Protos.size() || !Protos[Sym] ||
+            Protos[Sym]->getArgs().size() != Args.size() ||
+            Protos[Sym]->hasBuffers() || Args.size() > MaxBytecodeArgs)
+            return NoReg;
+        auto Symbol = State->TheJIT->findSymbol(symbolName(Sym).str());
+        if (!Symbol)
+            return NoReg;
+
+        Callees.push_back({cantFail(Symbol.getAddress()), (unsigned)Args.size()});
+        uint32_t Dst = newRegister();
+        emit(Op_Call, Dst, Callees.size() - 1, CallArgs.size());
+        CallArgs.insert(CallArgs.end(), Args.begin(), Args.end());
+        return Dst;
+    }
+
+    uint32_t compileBinary(ExprId E, uint32_t L, uint32_t R) {
+        ExprTable &AST = State->AST;
+        char Op = AST.opcode(E);
+        if (Op == '=') {
+            ExprId LHS = AST.operand(E, 0);
+            if (AST.kind(LHS) != Expr_Variable)
+                return NoReg;
+            uint32_t Var = VarRegs[AST.symbol(LHS)];
+            if (Var == NoReg)
+                return NoReg;
+            emit(Op_Move, Var, R);
+            ++Epoch;
+            return R;
+        }
+
+        Opcode Opc;
+        switch (Op) {
+        case '+':
+            Opc = Op_Add;
+            break;
+        case '-':
+            Opc = Op_Sub;
+            break;
+        case '*':
+            Opc = Op_Mul;
+            break;
+        case '<':
+            Opc = Op_Less;
+            break;
+        default:
+            uint32_t Ops[2] = {L, R};
+            return compileCall(getOperatorSymbol(true, Op), Ops);
+        }
+        uint32_t Dst = newRegister();
+        emit(Opc, Dst, L, R);
+        return Dst;
+    }
+
+    uint32_t compileIf(ExprId E) {
+        ExprTable &AST = State->AST;
+        uint32_t Cond = compileExpr(AST.operand(E, 0));
+        if (Cond == NoReg)
+            return NoReg;
+        uint32_t Dst = newRegister();
+        uint32_t ToElse = emit(Op_JumpIfNot, 0, Cond);
+
+        ++Epoch;
+        uint32_t Then = compileExpr(AST.operand(E, 1));
+        if (Then == NoReg)
+            return NoReg;
+        emit(Op_Move, Dst, Then);
+        uint32_t ToEnd = emit(Op_Jump, 0);
+
+        Code[ToElse].B = Code.size();
+        ++Epoch;
+        uint32_t Else = compileExpr(AST.operand(E, 2));
+        if (Else == NoReg)
+            return NoReg;
+        emit(Op_Move, Dst, Else);
+
+        Code[ToEnd].A = Code.size();
+        ++Epoch;
+        return Dst;
+    }
+
+    uint32_t compileVar(ExprId E) {
+        ExprTable &AST = State->AST;
+        ArrayRef<ExprId> Inits = AST.operands(E).drop_back();
+        size_t ScopeMark = Scopes.size();
+        for (unsigned i = 0, e = Inits.size(); i != e; ++i) {
+            uint32_t Init = Inits[i] == NoExpr ? compileNumber(0.0)
+                                               : compileExpr(Inits[i]);
+            if (Init == NoReg)
+                return NoReg;
+            uint32_t Var = newRegister();
+            emit(Op_Move, Var, Init);
+            bind(AST.varSymbol(E, i), Var);
+        }
+        uint32_t Body = compileExpr(AST.operands(E).back());
+        unbind(ScopeMark);
+        return Body;
+    }
+
+    // compileExpr - emit the bytecode for E, returning the register that
+    // holds its value, or NoReg if it is left to the JIT
+    uint32_t compileExpr(ExprId Root) {
+        ExprTable &AST = State->AST;
+        struct Frame {
+            ExprId E;
+            unsigned NextOperand;
+        };
+        SmallVector<Frame, 16> Frames;
+        SmallVector<uint32_t, 16> Regs;
+
+        Frames.push_back({Root, 0});
+        while (!Frames.empty()) {
+            ExprId E = Frames.back().E;
+            ArrayRef<ExprId> Operands = evaluatedOperands(E);
+            if (Frames.back().NextOperand < Operands.size()) {
+                ExprId Operand = Operands[Frames.back().NextOperand++];
+                auto &M = Memo[Operand];
+                if (M.first != NoReg && M.second == Epoch)
+                    Regs.push_back(M.first);
+                else
+                    Frames.push_back({Operand, 0});
+                continue;
+            }
+            Frames.pop_back();
+
+            ArrayRef<uint32_t> Args = makeArrayRef(Regs).take_back(Operands.size());
+            uint32_t Dst = NoReg;
+            switch (AST.kind(E)) {
+            case Expr_Number:
+                Dst = compileNumber(AST.number(E));
+                break;
+            case Expr_Variable:
+                // copied, since the variable may be assigned before the value
+                // is used
+                if (VarRegs[AST.symbol(E)] != NoReg)
+                    Dst = Code[emit(Op_Move, newRegister(),
+                                    VarRegs[AST.symbol(E)])].Dst;
+                break;
+            case Expr_Unary:
+                Dst = compileCall(getOperatorSymbol(false, AST.opcode(E)), Args);
+                break;
+            case Expr_Binary:
+                Dst = Args.size() == 2 ? compileBinary(E, Args[0], Args[1])
+                                       : compileBinary(E, NoReg, Args[0]);
+                break;
+            case Expr_If:
+                Dst = compileIf(E);
+                break;
+            case Expr_Var:
+                Dst = compileVar(E);
+                break;
+            case Expr_Call:
+                Dst = compileCall(AST.symbol(E), Args);
+                break;
+            case Expr_For:
+                // a loop may run any number of times, so it is worth compiling
+                break;
+            case Expr_Index:
+            case Expr_Store:
+                // only a function has buffers, compiling reports the error
+                break;
+            }
+            if (Dst == NoReg)
+                return NoReg;
+
+            if (isPureExpr(E))
+                Memo[E] = std::make_pair(Dst, Epoch);
+            Regs.resize(Regs.size() - Operands.size());
+            Regs.push_back(Dst);
+        }
+        return Regs.back();
+    }
+
+public:
+    // call - call C with the arguments in R that Args index, natively as a
+    // function of that many doubles. -batch-bench calls per row with it too.
+    static double call(const BytecodeCallee &C, const double *R,
+                       const uint32_t *Args) {
+        typedef double D;
+        switch (C.NumArgs) {
+        case 0:
+            return ((D(*)())C.Address)();
+        case 1:
+            return ((D(*)(D))C.Address)(R[Args[0]]);
+        case 2:
+            return ((D(*)(D, D))C.Address)(R[Args[0]], R[Args[1]]);
+        case 3:
+            return ((D(*)(D, D, D))C.Address)(R[Args[0]], R[Args[1]],
+                                              R[Args[2]]);
+        case 4:
+            return ((D(*)(D, D, D, D))C.Address)(R[Args[0]], R[Args[1]],
+                                                 R[Args[2]], R[Args[3]]);
+        case 5:
+            return ((D(*)(D, D, D, D, D))C.Address)(
+                R[Args[0]], R[Args[1]], R[Args[2]], R[Args[3]], R[Args[4]]);
+        case 6:
+            return ((D(*)(D, D, D, D, D, D))C.Address)(
+                R[Args[0]], R[Args[1]], R[Args[2]], R[Args[3]], R[Args[4]],
+                R[Args[5]]);
+        }
+        llvm_unreachable("more arguments than MaxBytecodeArgs");
+    }
+
+    // compile - compile the expression rooted at Root, returning false if it
+    // has to be left to the JIT: it has a loop, calls a function the JIT
+    // doesn't have or with more than MaxBytecodeArgs arguments, or has an
+    // error, which the JIT's codegen then reports
+    bool compile(ExprId Root) {
+        Code.clear();
+        Constants.clear();
+        Callees.clear();
+        CallArgs.clear();
+        ConstantRegs.clear();
+        Scopes.clear();
+        NumRegs = 0;
+        ++Epoch;
+        VarRegs.assign(State->SymbolNames.size(), NoReg);
+        Memo.assign(State->AST.size(), std::make_pair(NoReg, (uint64_t)0));
+
+        uint32_t Result = compileExpr(Root);
+        if (Result == NoReg)
+            return false;
+        emit(Op_Return, 0, Result);
+        State->NumBytecodeInsts += Code.size();
+        return true;
+    }
+
+    // run - interpret the compiled expression
+    double run() {
+        Registers.resize(NumRegs);
+        double *R = Registers.data();
+        for (auto &C : Constants)
+            R[C.first] = C.second;
+
+        const Instr *I = Code.data();
+        while (true) {
+            switch (I->Op) {
+            case Op_Move:
+                R[I->Dst] = R[I->A];
+                break;
+            case Op_Add:
+                R[I->Dst] = R[I->A] + R[I->B];
+                break;
+            case Op_Sub:
+                R[I->Dst] = R[I->A] - R[I->B];
+                break;
+            case Op_Mul:
+                R[I->Dst] = R[I->A] * R[I->B];
+                break;
+            case Op_Less:
+                R[I->Dst] = !(R[I->A] >= R[I->B]) ? 1.0 : 0.0;
+                break;
+            case Op_Jump:
+                I = Code.data() + I->A;
+                continue;
+            case Op_JumpIfNot:
+                if (!(R[I->A] < 0.0 || R[I->A] > 0.0)) {
+                    I = Code.data() + I->B;
+                    continue;
+                }
+                break;
+            case Op_Call:
+                R[I->Dst] = call(Callees[I->A], R, &CallArgs[I->B]);
+                break;
+            case Op_Return:
+                return R[I->A];
+            }
+            ++I;
+        }
+    }
+};
+} // end anonymous namespace
+
+//===----------------------------------------------------------------------===//
+// Compiled expression cache
+//===----------------------------------------------------------------------===//
+
+// A top-level expression that had to be compiled stays in the JIT after it
+// has run, so that when the same expression comes again it is just called.
+// Entries are keyed on the simplified expression, so spacing, comments and
+// subexpressions that folded away don't matter, and record the version of
+// every function the expression calls. An entry is stale once any of them
+// has been redefined, and is removed from the JIT when next looked up.
+
+namespace {
+class ExprCache {
+    struct Entry {
+        VModuleKey Module;
+        double (*Fn)();
+        std::vector<std::pair<SymbolId, uint64_t>> Deps;
+        uint64_t LastUsed;
+    };
+
+    StringMap<Entry> Entries;
+    uint64_t Clock = 0;
+    // the last expression looked up, for insert. Kept for their capacity.
+    std::string Key;
+    std::vector<SymbolId> Deps;
+    std::vector<ExprId> Numbering, Stack;
+
+    template <typename T> void append(T V) {
+        Key.append((const char *)&V, sizeof(V));
+    }
+
+    static uint64_t versionOf(SymbolId Sym) {
+        auto &Versions = State->PrototypeVersions;
+        return Sym < Versions.size() ? Versions[Sym] : 0;
+    }
+
+    // computeKey - serialize the nodes reachable from Root into Key,
+    // numbered in table order, and collect the functions they call in Deps
+    void computeKey(ExprId Root) {
+        ExprTable &AST = State->AST;
+        Key.clear();
+        Deps.clear();
+
+        // simplification leaves nodes nothing refers to any more
+        Numbering.assign(AST.size(), NoExpr);
+        Numbering[Root] = 0;
+        Stack.assign(1, Root);
+        while (!Stack.empty()) {
+            ExprId E = Stack.back();
+            Stack.pop_back();
+            for (ExprId Op : AST.operands(E))
+                if (Op != NoExpr && Numbering[Op] == NoExpr) {
+                    Numbering[Op] = 0;
+                    Stack.push_back(Op);
+                }
+        }
+        ExprId Next = 0;
+        for (ExprId &N : Numbering)
+            if (N != NoExpr)
+                N = Next++;
+
+        for (ExprId E = 0, End = AST.size(); E != End; ++E) {
+            if (Numbering[E] == NoExpr)
+                continue;
+            ArrayRef<ExprId> Operands = AST.operands(E);
+            append(AST.kind(E));
+            switch (AST.kind(E)) {
+            case Expr_Number:
+                append(AST.number(E));
+                break;
+            case Expr_Var:
+                for (unsigned I = 0; I + 1 < Operands.size(); ++I)
+                    append(AST.varSymbol(E, I));
+                break;
+            case Expr_Unary:
+                append(AST.opcode(E));
+                Deps.push_back(getOperatorSymbol(false, AST.opcode(E)));
+                break;
+            case Expr_Binary:
+                append(AST.opcode(E));
+                if (!isPureBinop(AST.opcode(E)) && AST.opcode(E) != '=')
+                    Deps.push_back(getOperatorSymbol(true, AST.opcode(E)));
+                break;
+            case Expr_Call:
+                append(AST.symbol(E));
+                Deps.push_back(AST.symbol(E));
+                break;
+            case Expr_Variable:
+            case Expr_For:
+            case Expr_Index:
+            case Expr_Store:
+                append(AST.symbol(E));
+                break;
+            case Expr_If:
+                break;
+            }
+            append((uint32_t)Operands.size());
+            for (ExprId Op : Operands)
+                append(Op == NoExpr ? NoExpr : Numbering[Op]);
+        }
+        append(Numbering[Root]);
+    }
+
+public:
+    uint64_t NumHits = 0, NumMisses = 0, NumInvalidated = 0, NumEvicted = 0;
+
+    // lookup - the code compiled for expression Root, if it has been and
+    // nothing it calls has been redefined since. Otherwise null, and insert
+    // can be given its code.
+    double (*lookup(ExprId Root))() {
+        computeKey(Root);
+        auto I = Entries.find(Key);
+        if (I == Entries.end()) {
+            ++NumMisses;
+            return nullptr;
+        }
+        Entry &E = I->second;
+        for (auto &Dep : E.Deps)
+            if (versionOf(Dep.first) != Dep.second) {
+                State->TheJIT->removeModule(E.Module);
+                Entries.erase(I);
+                ++NumInvalidated;
+                ++NumMisses;
+                return nullptr;
+            }
+        E.LastUsed = ++Clock;
+        ++NumHits;
+        return E.Fn;
+    }
+
+    // insert - keep Fn, in the JIT as Module, as the code of the expression
+    // last looked up, making room by removing the least recently used entry
+    void insert(VModuleKey Module, double (*Fn)(), unsigned MaxEntries) {
+        if (Entries.size() >= MaxEntries) {
+            auto Oldest = Entries.begin();
+            for (auto I = Entries.begin(), End = Entries.end(); I != End; ++I)
+                if (I->second.LastUsed < Oldest->second.LastUsed)
+                    Oldest = I;
+            State->TheJIT->removeModule(Oldest->second.Module);
+            Entries.erase(Oldest);
+            ++NumEvicted;
+        }
+        Entry &E = Entries[Key];
+        E.Module = Module;
+        E.Fn = Fn;
+        E.Deps.clear();
+        for (SymbolId Sym : Deps)
+            E.Deps.push_back(std::make_pair(Sym, versionOf(Sym)));
+        E.LastUsed = ++Clock;
+    }
+};
+} // end anonymous namespace
+
 //===----------------------------------------------------------------------===//
 // "Library" functions that can be "extern'd" from user code.
 //===----------------------------------------------------------------------===//
@@ -1127,20 +4068,46 @@ extern "C" DLLEXPORT double printd(double X) {
 }
 
 static void HandleTopLevelExpression() {
+    const CompilerOptions &Options = State->Options;
     // Evaluate a top-level expression into an anonymous function.
     if (auto ExprAST = ParseTopLevelExpr()) {
-        if (auto *ExprIR = ExprAST->codegen()){
+        ExprAST->simplify();
+
+        // the definitions it calls have to be in the JIT, unless it folded
+        // to a constant, which needs no code at all
+        if (!ExprAST->isConstant())
+            flushDefinitions();
+
+        if (ExprAST->isConstant()) {
+            fprintf(stderr, "Evaluated to %f\n", ExprAST->getConstant());
+            ++State->NumConstantExprs;
+        } else if (Options.Interpret && [&] {
+                       TimeRegion T(phaseTimer(InterpTimer));
+                       return State->TheBytecode->compile(ExprAST->getBody());
+                   }()) {
+            // one-shot code is interpreted rather than compiled
+            TimeRegion T(phaseTimer(InterpTimer));
+            fprintf(stderr, "Evaluated to %f\n", State->TheBytecode->run());
+            ++State->NumInterpretedExprs;
+        } else if (auto Fn =
+                       Options.ExprCacheSize
+                           ? State->TheExprCache->lookup(ExprAST->getBody())
+                           : nullptr) {
+            // compiled before, and nothing it calls has changed since
+            fprintf(stderr, "Evaluated to %f\n", Fn());
+        } else if (auto *ExprIR = ExprAST->codegen()){
             fprintf(stderr, "Read top-level expression: ");
             ExprIR->print(errs());
             fprintf(stderr, "\n");
 
             // JIT the module containing the anaymous expression, keeping a
             // handle so we can free it later
-            auto H = TheJIT->addModule(std::move(TheModule));
+            runModulePipeline(*State->TheModule);
+            auto H = State->TheJIT->addModule(std::move(State->TheModule));
             InitializeModuleAndPassManager();
 
             // search the JIT for the __anon_expr symbol
-            auto ExprSymbol = TheJIT->findSymbol("__anon_expr");
+            auto ExprSymbol = State->TheJIT->findSymbol("__anon_expr");
             assert(ExprSymbol && "Function not found");
 
             // Get the symbols address and cast it to the right type
@@ -1149,27 +4116,36 @@ static void HandleTopLevelExpression() {
             double (*FP)() = (double (*)())(intptr_t)cantFail(ExprSymbol.getAddress());
             fprintf(stderr, "Evaluated to %f\n", FP());
 
-            // delete the anonymous expression module from the JIT
-            TheJIT->removeModule(H);
+            // keep it for the next time the expression comes, or delete the
+            // anonymous expression module from the JIT
+            if (Options.ExprCacheSize)
+                State->TheExprCache->insert(H, FP, Options.ExprCacheSize);
+            else
+                State->TheJIT->removeModule(H);
         }
     } else {
         // Skip token for error recovery.
         getNextToken();
     }
+
+    ResetAST();
 }
 
 static void MainLoop(){
     while (true){
-        switch (CurTok){
+        switch (State->CurTok){
         case tok_eof:
             return;
         case ';':
             getNextToken();
             break;
         case tok_def:
-            HandleDefinition();
+            if (!State->ThePipeline || !State->ThePipeline->takeUnit())
+                HandleDefinition();
             break;
         case tok_extern:
+            if (State->ThePipeline)
+                State->ThePipeline->reachExtern();
             HandleExtern();
             break;
         default:
@@ -1180,32 +4156,744 @@ static void MainLoop(){
 }
 
 //===----------------------------------------------------------------------===//
-// Main driver code.
+// Batch evaluation
 //===----------------------------------------------------------------------===//
 
-int main() {
+// BatchLoopFn - a loop evaluating a function over columns of arguments:
+// Out[r] = f(Columns[0][r], Columns[1][r], ...) for each of the Rows rows.
+// Out must not overlap the columns.
+typedef void BatchLoopFn(const double *const *Columns, double *Out,
+                         int64_t Rows);
+
+// generateBatchLoop - compile a BatchLoopFn for the function Name, or
+// return null if it isn't a function of numbers. The loop is a module of
+// its own, handed to the JIT like a top-level expression's and optimized the
+// same way, so with -O2 or -O3 the function is copied in (if -import-size
+// allows), inlined and the loop vectorized. The inner loop takes each column
+// as a noalias argument, so the vectorizer needs no overlap checks.
+static BatchLoopFn *generateBatchLoop(StringRef Name) {
+    SymbolId Sym = State->SymbolIds.lookup(Name);
+    if (Sym == NoSymbol || Sym >= State->FunctionProtos.size() ||
+        !State->FunctionProtos[Sym]) {
+        LogErrorV("Unknown function referenced");
+        return nullptr;
+    }
+    if (State->FunctionProtos[Sym]->hasBuffers()) {
+        LogErrorV("A function of buffers can't be evaluated over columns");
+        return nullptr;
+    }
+    unsigned NumArgs = State->FunctionProtos[Sym]->getArgs().size();
+
+    // the function has to be in the JIT, and the loop in a module of its own
+    flushDefinitions();
+    Function *F = getFunction(Sym);
+    Type *DoubleTy = Type::getDoubleTy(*State->TheContext);
+    Type *PtrTy = DoubleTy->getPointerTo();
+    Type *Int64Ty = Type::getInt64Ty(*State->TheContext);
+    Type *VoidTy = Type::getVoidTy(*State->TheContext);
+
+    // the loop: void (double *Out, double *Column..., i64 Rows)
+    std::vector<Type *> Params(NumArgs + 1, PtrTy);
+    Params.push_back(Int64Ty);
+    Function *Loop = Function::Create(FunctionType::get(VoidTy, Params, false),
+                                      Function::InternalLinkage,
+                                      "__batch_loop", State->TheModule.get());
+    for (unsigned I = 0; I != NumArgs + 1; ++I) {
+        Loop->addParamAttr(I, Attribute::NoAlias);
+        Loop->addParamAttr(
+            I, Attribute::getWithAlignment(*State->TheContext, 8));
+    }
+    auto LoopArg = Loop->arg_begin();
+    Value *Out = &*LoopArg++;
+    SmallVector<Value *, 8> Bufs;
+    for (unsigned I = 0; I != NumArgs; ++I)
+        Bufs.push_back(&*LoopArg++);
+    Value *Rows = &*LoopArg;
+
+    BasicBlock *EntryBB = BasicBlock::Create(*State->TheContext, "entry", Loop);
+    BasicBlock *LoopBB = BasicBlock::Create(*State->TheContext, "loop", Loop);
+    BasicBlock *AfterBB =
+        BasicBlock::Create(*State->TheContext, "afterloop", Loop);
+    State->Builder->SetInsertPoint(EntryBB);
+    State->Builder->CreateCondBr(
+        State->Builder->CreateICmpSGT(Rows, ConstantInt::get(Int64Ty, 0)),
+        LoopBB, AfterBB);
+
+    State->Builder->SetInsertPoint(LoopBB);
+    PHINode *Row = State->Builder->CreatePHI(Int64Ty, 2, "row");
+    Row->addIncoming(ConstantInt::get(Int64Ty, 0), EntryBB);
+    SmallVector<Value *, 8> ArgsV;
+    for (Value *Buf : Bufs) {
+        Value *Addr = State->Builder->CreateInBoundsGEP(Buf, Row, "eltaddr");
+        ArgsV.push_back(State->Builder->CreateAlignedLoad(Addr, 8, "arg"));
+    }
+    Value *V = State->Builder->CreateCall(F, ArgsV, "calltmp");
+    Value *Addr = State->Builder->CreateInBoundsGEP(Out, Row, "eltaddr");
+    State->Builder->CreateAlignedStore(V, Addr, 8);
+    Value *NextRow = State->Builder->CreateAdd(
+        Row, ConstantInt::get(Int64Ty, 1), "nextrow", /*HasNUW=*/true,
+        /*HasNSW=*/true);
+    Row->addIncoming(NextRow, LoopBB);
+    State->Builder->CreateCondBr(State->Builder->CreateICmpEQ(NextRow, Rows),
+                                 AfterBB, LoopBB)
+        ->setMetadata(LLVMContext::MD_loop, makeLoopID());
+
+    State->Builder->SetInsertPoint(AfterBB);
+    State->Builder->CreateRetVoid();
+
+    // the entry point takes the columns as an array, and passes them on
+    Type *ColumnsTy = PtrTy->getPointerTo();
+    Function *Entry = Function::Create(
+        FunctionType::get(VoidTy, {ColumnsTy, PtrTy, Int64Ty}, false),
+        Function::ExternalLinkage, "__batch_" + Name, State->TheModule.get());
+    State->Builder->SetInsertPoint(
+        BasicBlock::Create(*State->TheContext, "entry", Entry));
+    auto EntryArg = Entry->arg_begin();
+    Value *Columns = &*EntryArg++;
+    SmallVector<Value *, 8> LoopArgs(1, &*EntryArg++);
+    for (unsigned I = 0; I != NumArgs; ++I) {
+        Value *ColumnAddr =
+            State->Builder->CreateConstInBoundsGEP1_64(Columns, I);
+        LoopArgs.push_back(
+            State->Builder->CreateAlignedLoad(ColumnAddr, 8, "column"));
+    }
+    LoopArgs.push_back(&*EntryArg);
+    State->Builder->CreateCall(Loop, LoopArgs);
+    State->Builder->CreateRetVoid();
+
+    verifyFunction(*Loop);
+    verifyFunction(*Entry);
+    if (State->TheFPM) {
+        TimeRegion T(phaseTimer(OptTimer));
+        State->TheFPM->run(*Loop);
+    }
+    runModulePipeline(*State->TheModule);
+    State->TheJIT->addModule(std::move(State->TheModule));
+    InitializeModuleAndPassManager();
 
-    LLVMInitializeNativeTarget();
-    LLVMInitializeNativeAsmPrinter();
-    LLVMInitializeNativeAsmParser();
+    auto Symbol = State->TheJIT->findSymbol(("__batch_" + Name).str());
+    assert(Symbol && "Function not found");
+    return (BatchLoopFn *)(intptr_t)cantFail(Symbol.getAddress());
+}
 
-    // Install standard binary operators
-    // 1 is the lowest precedence
-    BinopPrecedence['='] = 2;
-    BinopPrecedence['<'] = 10;
-    BinopPrecedence['+'] = 20;
-    BinopPrecedence['-'] = 30;
-    BinopPrecedence['*'] = 40; // highest
+//===----------------------------------------------------------------------===//
+// Main driver code.
+//===----------------------------------------------------------------------===//
 
-    // prime the first token
+// LexInput - run the lexer over the whole input and report how fast it went.
+// This is the benchmark to watch for lexer regressions:
+//      ./toy -lex-only big.ks
+static void LexInput() {
+    uint64_t NumTokens = 0;
+    auto Start = std::chrono::steady_clock::now();
+    while (gettok() != tok_eof)
+        ++NumTokens;
+    std::chrono::duration<double> Elapsed =
+        std::chrono::steady_clock::now() - Start;
+
+    double MB = State->Source->BytesRead / (1024.0 * 1024.0);
+    fprintf(stderr, "Lexed %llu tokens, %.2f MB in %.3fs (%.1f MB/s)\n",
+            (unsigned long long)NumTokens, MB, Elapsed.count(),
+            MB / Elapsed.count());
+}
+
+// ParseInput - parse the whole input without generating any code and report
+// how fast it went. This is the benchmark for parser changes, and with very
+// long generated expressions the stress test that parsing stays linear:
+//      ./toy -parse-only huge.ks
+static void ParseInput() {
+    uint64_t NumItems = 0, NumNodes = 0;
+    auto Start = std::chrono::steady_clock::now();
     getNextToken();
+    while (State->CurTok != tok_eof) {
+        bool Parsed = true;
+        switch (State->CurTok) {
+        case ';':
+            getNextToken();
+            continue;
+        case tok_def:
+            Parsed = ParseDefinition() != nullptr;
+            break;
+        case tok_extern:
+            Parsed = ParseExtern() != nullptr;
+            break;
+        default:
+            Parsed = ParseTopLevelExpr() != nullptr;
+            break;
+        }
 
-    TheJIT = llvm::make_unique<KaleidoscopeJIT>();
+        // skip a token for error recovery, just like MainLoop
+        if (!Parsed)
+            getNextToken();
+        ++NumItems;
+        NumNodes += State->AST.size();
+        ResetAST();
+    }
+    std::chrono::duration<double> Elapsed =
+        std::chrono::steady_clock::now() - Start;
 
-    InitializeModuleAndPassManager();
+    fprintf(stderr, "Parsed %llu items, %llu expression nodes in %.3fs "
+            "(%.2f M nodes/s)\n",
+            (unsigned long long)NumItems, (unsigned long long)NumNodes,
+            Elapsed.count(), NumNodes / Elapsed.count() / 1e6);
+}
+
+// BatchBenchmark - evaluate the -batch-bench function over -batch-rows rows
+// of arguments, calling it through a function pointer once per row and then
+// with the loop generateBatchLoop compiles, and report how fast each went,
+// taking the best of a few passes. This is the benchmark for batch
+// evaluation:
+//      ./toy -O3 -batch-bench=f formula.ks
+static void BatchBenchmark() {
+    flushDefinitions();
+    SymbolId Sym = State->SymbolIds.lookup(BatchBench);
+    auto &Protos = State->FunctionProtos;
+    if (Sym == NoSymbol || Sym >= Protos.size() || !Protos[Sym] ||
+        Protos[Sym]->hasBuffers() ||
+        Protos[Sym]->getArgs().size() > MaxBytecodeArgs) {
+        fprintf(stderr, "-batch-bench needs a function of at most %u "
+                "numbers\n", MaxBytecodeArgs);
+        return;
+    }
+    auto Symbol = State->TheJIT->findSymbol(BatchBench);
+    if (!Symbol) {
+        consumeError(Symbol.takeError());
+        return;
+    }
+    BytecodeCallee Callee = {cantFail(Symbol.getAddress()),
+                             (unsigned)Protos[Sym]->getArgs().size()};
+
+    // the same arguments every run, spread over [-4, 4)
+    const size_t Rows = BatchRows;
+    std::vector<std::vector<double>> Columns(Callee.NumArgs,
+                                             std::vector<double>(Rows));
+    std::vector<const double *> ColumnPtrs;
+    uint64_t Seed = 88172645463325252ull;
+    for (auto &Column : Columns) {
+        for (double &V : Column) {
+            Seed ^= Seed << 13;
+            Seed ^= Seed >> 7;
+            Seed ^= Seed << 17;
+            V = std::ldexp((double)(Seed >> 11), -50) - 4.0;
+        }
+        ColumnPtrs.push_back(Column.data());
+    }
+    std::vector<double> PerRow(Rows), Batched(Rows);
+
+    typedef std::chrono::duration<double> Seconds;
+    auto bestOf = [](function_ref<void()> Pass) {
+        Seconds Best = Seconds::max();
+        for (unsigned I = 0; I != 5; ++I) {
+            auto Start = std::chrono::steady_clock::now();
+            Pass();
+            Best = std::min<Seconds>(Best,
+                                     std::chrono::steady_clock::now() - Start);
+        }
+        return Best;
+    };
+
+    Seconds PerRowTime = bestOf([&] {
+        double Row[MaxBytecodeArgs];
+        const uint32_t Args[MaxBytecodeArgs] = {0, 1, 2, 3, 4, 5};
+        for (size_t R = 0; R != Rows; ++R) {
+            for (unsigned C = 0; C != Callee.NumArgs; ++C)
+                Row[C] = Columns[C][R];
+            PerRow[R] = Bytecode::call(Callee, Row, Args);
+        }
+    });
+    auto Start = std::chrono::steady_clock::now();
+    BatchLoopFn *Loop = generateBatchLoop(BatchBench);
+    if (!Loop)
+        return;
+    Seconds CompileTime = std::chrono::steady_clock::now() - Start;
+    Seconds LoopTime =
+        bestOf([&] { Loop(ColumnPtrs.data(), Batched.data(), Rows); });
+    size_t Differ = 0;
+    for (size_t R = 0; R != Rows; ++R)
+        Differ += std::memcmp(&PerRow[R], &Batched[R], sizeof(double)) != 0;
+    fprintf(stderr, "Evaluated %s over %zu rows: %.1f M rows/s calling it "
+            "per row, %.1f M rows/s in a compiled loop (compiled in "
+            "%.3fs)\n", BatchBench.c_str(), Rows,
+            Rows / PerRowTime.count() / 1e6, Rows / LoopTime.count() / 1e6,
+            CompileTime.count());
+    if (Differ)
+        fprintf(stderr, "The loop's results differ in %zu rows\n", Differ);
+}
+
+// PrintStatistics - report the counters requested with -toy-stats
+static void PrintStatistics() {
+    const CompilerOptions &Options = State->Options;
+    fprintf(stderr, "Peak expression table: %zu nodes, %zu bytes\n",
+            State->PeakASTNodes, State->PeakASTBytes);
+    fprintf(stderr, "Hash consing: %llu of %llu nodes shared, %llu values "
+            "reused by codegen\n",
+            (unsigned long long)State->NumSharedNodes,
+            (unsigned long long)State->NumParsedNodes,
+            (unsigned long long)State->NumMemoHits);
+    fprintf(stderr, "IR generated: %llu instructions before optimization\n",
+            (unsigned long long)State->NumIRInsts);
+    if (Options.Tiered)
+        fprintf(stderr, "Tiered compilation: %u functions recompiled hot\n",
+                State->TheJIT->getNumTierUps());
+    if (Options.LazyCompile && !Options.Tiered && Options.SpeculateThreads) {
+        auto Stats = State->TheJIT->getSpeculationStats();
+        fprintf(stderr, "Speculative compilation: %u hits, %u misses, %u "
+                "wasted\n", Stats.Hits, Stats.Misses, Stats.Wasted);
+    }
+    if (auto *Cache = State->TheJIT->getObjectCache()) {
+        auto Stats = Cache->getStats();
+        fprintf(stderr, "Object cache: %llu hits, %llu misses, %llu entries "
+                "rejected, %llu stored\n", (unsigned long long)Stats.Hits,
+                (unsigned long long)Stats.Misses,
+                (unsigned long long)Stats.Rejected,
+                (unsigned long long)Stats.Stored);
+    }
+    if (importsDefinitions())
+        fprintf(stderr, "Functions copied into callers: %u\n",
+                State->TheImports->NumImported);
+    if (Options.ExprCacheSize)
+        fprintf(stderr, "Expression cache: %llu hits, %llu misses, %llu "
+                "invalidated, %llu evicted\n",
+                (unsigned long long)State->TheExprCache->NumHits,
+                (unsigned long long)State->TheExprCache->NumMisses,
+                (unsigned long long)State->TheExprCache->NumInvalidated,
+                (unsigned long long)State->TheExprCache->NumEvicted);
+    if (Options.Jobs)
+        fprintf(stderr, "Parallel front end: %u units compiled on %u "
+                "threads\n", State->NumPipelinedUnits, (unsigned)Options.Jobs);
+    if (Options.Interpret)
+        fprintf(stderr, "Bytecode: %llu top-level expressions interpreted, "
+                "%llu instructions\n",
+                (unsigned long long)State->NumInterpretedExprs,
+                (unsigned long long)State->NumBytecodeInsts);
+    fprintf(stderr, "Expressions simplified: %llu nodes folded, %llu "
+            "top-level expressions answered without the JIT\n",
+            (unsigned long long)State->NumFolded,
+            (unsigned long long)State->NumConstantExprs);
+}
+
+// compileInput - compile and run everything Source holds
+static void compileInput() {
+    // a file can have its definitions compiled ahead on worker threads
+    if (State->Options.Jobs && !State->Source->isInteractive()) {
+        State->ThePipeline = llvm::make_unique<Pipeline>();
+        State->ThePipeline->scan();
+        State->ThePipeline->start(State->Options.Jobs);
+    }
+
+    // prime the first token
+    getNextToken();
 
     // run the main interpreter loop now
     MainLoop();
+    flushDefinitions();
+    State->ThePipeline.reset();
+}
+
+//===----------------------------------------------------------------------===//
+// Compiler sessions
+//===----------------------------------------------------------------------===//
+
+CompilerState::CompilerState()
+    : TheImports(llvm::make_unique<ImportStore>()),
+      TheBytecode(llvm::make_unique<Bytecode>()),
+      TheExprCache(llvm::make_unique<ExprCache>()) {}
+
+CompilerState::~CompilerState() = default;
+
+// CompilerSession - one Kaleidoscope compiler: its symbol and prototype
+// tables, operators, IR context and JIT. Sessions are independent, so any
+// number can run at once on different threads. A session itself must only
+// be used by one thread at a time, but the functions it returns may be
+// called on any thread.
+//
+// The compiler's code works on the CompilerState that State points at. Each
+// call points State at the session's for its duration, and back at whatever
+// it pointed at before on return, so a session can call into another. It
+// also holds the JIT's lock: with -lazy or -tiered, calling a function may
+// compile it on the calling thread, from IR in the session's context.
+class CompilerSession {
+    LLVMContext Context;
+    IRBuilder<> SessionBuilder{Context};
+    SourceBuffer SessionSource;
+    std::unique_ptr<KaleidoscopeJIT> JIT;
+    CompilerState SessionState;
+
+    // Activation - make the session current for a scope
+    class Activation {
+        CompilerState *Outer;
+        std::lock_guard<std::recursive_mutex> Lock;
+
+    public:
+        Activation(CompilerSession &S)
+            : Outer(State), Lock(S.JIT->getMutex()) {
+            State = &S.SessionState;
+        }
+        ~Activation() { State = Outer; }
+    };
+
+    JITTargetAddress lookupAddress(StringRef Name);
+
+public:
+    // CompilerSession - a session compiling with Options, which it keeps a
+    // copy of
+    explicit CompilerSession(
+        const CompilerOptions &Options = CompilerOptions());
+    ~CompilerSession();
+
+    // compile - compile and run Src, a sequence of definitions, externs and
+    // top-level expressions, as if it were a file named on the command line.
+    // Returns false if anything in it failed to compile.
+    bool compile(StringRef Src);
+
+    // lookup - a function the session has defined, as a pointer of type FnT,
+    // e.g. lookup<double(double)>("sq"), or null if there is no such function.
+    // It may be called on any thread, even while the session is compiling;
+    // with -lazy or -tiered its first call, or the one that finds it hot,
+    // waits for the session to finish, then compiles it under the JIT's lock.
+    template <typename FnT> FnT *lookup(StringRef Name) {
+        return reinterpret_cast<FnT *>(lookupAddress(Name));
+    }
+
+    // compileBatch - a loop evaluating the function Name over columns of
+    // arguments, one column per argument, into an output column, or null if
+    // there is no such function of numbers. See BatchLoopFn.
+    BatchLoopFn *compileBatch(StringRef Name) {
+        return withState([&] { return generateBatchLoop(Name); });
+    }
+
+    // withState - call F with this session current, for the driver, which
+    // works the lexer and parser directly
+    template <typename Fn> auto withState(Fn F) -> decltype(F()) {
+        Activation A(*this);
+        return F();
+    }
+};
+
+// resolveCPU - the CPU named by -mcpu or -multiversion, with native
+// standing for the host's
+static std::string resolveCPU(StringRef CPU) {
+    return CPU == "native" ? sys::getHostCPUName().str() : CPU.str();
+}
+
+// targetFeatures - the features code is generated with on top of -mcpu's
+// CPU: with -mcpu=native those the host has and lacks, so that a feature
+// the CPU name implies but this host doesn't have, or that the OS doesn't
+// save the registers of, is left out, and then -mattr's
+static std::vector<std::string>
+targetFeatures(const CompilerOptions &Options) {
+    std::vector<std::string> Features;
+    StringMap<bool> HostFeatures;
+    if (Options.MCPU == "native" && sys::getHostCPUFeatures(HostFeatures))
+        for (auto &F : HostFeatures)
+            Features.push_back((F.second ? "+" : "-") + F.first().str());
+    // sorted, as they go into the object cache's keys
+    std::sort(Features.begin(), Features.end());
+    Features.insert(Features.end(), Options.MAttrs.begin(),
+                    Options.MAttrs.end());
+    return Features;
+}
+
+// initializeNativeTarget - register the host target with LLVM, once per
+// process however many sessions there are
+static void initializeNativeTarget() {
+    static bool Initialized = [] {
+        LLVMInitializeNativeTarget();
+        LLVMInitializeNativeAsmPrinter();
+        LLVMInitializeNativeAsmParser();
+        return true;
+    }();
+    (void)Initialized;
+}
+
+CompilerSession::CompilerSession(const CompilerOptions &Options) {
+    initializeNativeTarget();
+    setUpContext(Context, Options);
+    JIT = llvm::make_unique<KaleidoscopeJIT>(resolveCPU(Options.MCPU),
+                                             targetFeatures(Options));
+    if (Options.Tiered)
+        JIT->enableTiering(optimizeHot, Options.TierUpCalls,
+                           Options.TierUpIterations);
+    else if (Options.LazyCompile && Options.SpeculateThreads)
+        JIT->enableSpeculation(Options.SpeculateThreads);
+    if (!Options.ObjectCacheDir.empty())
+        if (auto EC = JIT->enableObjectCache(Options.ObjectCacheDir,
+                                             Options.ObjectCacheSize * 1024ull *
+                                                 1024))
+            errs() << "Can't use object cache " << Options.ObjectCacheDir
+                   << ": " << EC.message() << "\n";
+
+    SessionState.Options = Options;
+    SessionState.TheContext = &Context;
+    SessionState.Builder = &SessionBuilder;
+    SessionState.TheJIT = JIT.get();
+    SessionState.TheTargetMachine = &JIT->getTargetMachine();
+    SessionState.Source = &SessionSource;
+
+    // Install standard binary operators
+    // 1 is the lowest precedence
+    SessionState.BinopPrecedence['='] = 2;
+    SessionState.BinopPrecedence['<'] = 10;
+    SessionState.BinopPrecedence['+'] = 20;
+    SessionState.BinopPrecedence['-'] = 30;
+    SessionState.BinopPrecedence['*'] = 40; // highest
+
+    withState(InitializeModuleAndPassManager);
+}
+
+CompilerSession::~CompilerSession() {
+    // the JIT goes first: it holds modules in Context and the workers'
+    // contexts, and runs code that may use the interpreter's callees
+    SessionState.ThePipeline.reset();
+    JIT.reset();
+}
+
+bool CompilerSession::compile(StringRef Src) {
+    return withState([&] {
+        unsigned Errors = State->NumErrors;
+        State->Source->openMemory(Src);
+        compileInput();
+        return State->NumErrors == Errors;
+    });
+}
+
+JITTargetAddress CompilerSession::lookupAddress(StringRef Name) {
+    return withState([&]() -> JITTargetAddress {
+        // the function may still be waiting for the rest of its batch
+        flushDefinitions();
+        auto Sym = State->TheJIT->findSymbol(Name.str());
+        if (!Sym) {
+            consumeError(Sym.takeError());
+            return 0;
+        }
+        auto Addr = Sym.getAddress();
+        if (!Addr) {
+            consumeError(Addr.takeError());
+            return 0;
+        }
+        return *Addr;
+    });
+}
+
+//===----------------------------------------------------------------------===//
+// Object file output
+//===----------------------------------------------------------------------===//
+
+// linkDefinitions - link the definitions kept for output.o into M. A
+// redefinition replaces the definition it redefines, as it does in the JIT
+// for the code compiled after it.
+static bool linkDefinitions(Module &M) {
+    for (auto &Bitcode : State->ObjectDefinitions) {
+        auto Src = cantFail(parseBitcodeFile(
+            MemoryBufferRef(Bitcode, "definitions"), M.getContext()));
+        for (auto &F : *Src)
+            if (!F.isDeclaration() && !F.hasLocalLinkage())
+                if (auto *Old = M.getFunction(F.getName()))
+                    Old->deleteBody();
+        if (Linker::linkModules(M, std::move(Src))) {
+            errs() << "Can't link the definitions into output.o\n";
+            return false;
+        }
+    }
+    State->ObjectDefinitions.clear();
+    return true;
+}
+
+// With -multiversion, each function in output.o that has a loop, where the
+// instruction set matters most, is compiled once for each CPU listed, by
+// giving a copy of it that CPU as its target-cpu, with -mattr's features on
+// top, and once more for -mcpu, as the fallback. The function's own symbol becomes a dispatcher, which
+// calls the version a module constructor chose, the first listed whose
+// features the machine running it has all of. The versions call each
+// other's versions for the same CPU directly, so only calls from outside
+// pay for the dispatch.
+//
+// The features are read from __cpu_model, which libgcc and compiler-rt fill
+// in for __builtin_cpu_supports. Only the features in its first word can be
+// tested, which covers the CPUs up to Skylake's AVX-512.
+static const struct {
+    const char *Name;
+    unsigned Bit;
+} DispatchFeatures[] = {
+    {"popcnt", 2},           {"sse3", 5},          {"ssse3", 6},
+    {"sse4.1", 7},           {"sse4.2", 8},        {"avx", 9},
+    {"avx2", 10},            {"sse4a", 11},        {"fma4", 12},
+    {"xop", 13},             {"fma", 14},          {"avx512f", 15},
+    {"bmi", 16},             {"bmi2", 17},         {"aes", 18},
+    {"pclmul", 19},          {"avx512vl", 20},     {"avx512bw", 21},
+    {"avx512dq", 22},        {"avx512cd", 23},     {"avx512er", 24},
+    {"avx512pf", 25},        {"avx512vbmi", 26},   {"avx512ifma", 27},
+    {"avx512vpopcntdq", 30},
+};
+
+// emitVersionChoice - a module constructor setting Choice to the index of
+// the first CPU whose features, as a mask of DispatchFeatures, the machine
+// has, or to the fallback's, after the last
+static void emitVersionChoice(Module &M, GlobalVariable *Choice,
+                              ArrayRef<uint32_t> Masks) {
+    LLVMContext &Ctx = M.getContext();
+    Type *Int32Ty = Type::getInt32Ty(Ctx);
+    auto *Init = Function::Create(
+        FunctionType::get(Type::getVoidTy(Ctx), false),
+        GlobalValue::InternalLinkage, "__multiversion_choose", &M);
+    IRBuilder<> B(BasicBlock::Create(Ctx, "entry", Init));
+
+    // the model may not be filled in yet if another constructor calls us
+    B.CreateCall(M.getOrInsertFunction("__cpu_indicator_init",
+                                       FunctionType::get(Int32Ty, false)));
+    auto *ModelTy = StructType::get(Int32Ty, Int32Ty, Int32Ty,
+                                    ArrayType::get(Int32Ty, 1));
+    Constant *Model = M.getOrInsertGlobal("__cpu_model", ModelTy);
+    Value *Features = B.CreateLoad(
+        Int32Ty,
+        B.CreateInBoundsGEP(ModelTy, Model,
+                            {B.getInt32(0), B.getInt32(3), B.getInt32(0)}),
+        "features");
+
+    Value *Chosen = B.getInt32(Masks.size());
+    for (unsigned V = Masks.size(); V-- != 0;) {
+        Value *Mask = B.getInt32(Masks[V]);
+        Value *Has = B.CreateICmpEQ(B.CreateAnd(Features, Mask), Mask);
+        Chosen = B.CreateSelect(Has, B.getInt32(V), Chosen);
+    }
+    B.CreateStore(Chosen, Choice);
+    B.CreateRetVoid();
+    appendToGlobalCtors(M, Init, 65535);
+}
+
+// multiversionFunctions - version M's functions with loops for the
+// -multiversion CPUs, with T's code generator
+static bool multiversionFunctions(Module &M, const Target &T) {
+    Triple TT(M.getTargetTriple());
+    if (TT.getArch() != Triple::x86 && TT.getArch() != Triple::x86_64) {
+        errs() << "-multiversion is only supported on x86\n";
+        return false;
+    }
+
+    // only -mattr's features: with -mcpu=native, the host's describe it,
+    // not the CPUs listed
+    std::string Attrs = join(State->Options.MAttrs, ",");
+    std::vector<std::string> CPUs;
+    std::vector<uint32_t> Masks;
+    for (auto &Name : State->Options.Multiversion) {
+        std::string CPU = resolveCPU(Name);
+        std::unique_ptr<MCSubtargetInfo> STI(
+            T.createMCSubtargetInfo(TT.str(), CPU, Attrs));
+        if (!STI->isCPUStringValid(CPU)) {
+            errs() << "Unknown CPU '" << CPU << "' for -multiversion\n";
+            return false;
+        }
+        uint32_t Mask = 0;
+        for (auto &F : DispatchFeatures)
+            if (STI->checkFeatures(std::string("+") + F.Name))
+                Mask |= 1u << F.Bit;
+        CPUs.push_back(CPU);
+        Masks.push_back(Mask);
+    }
+
+    std::vector<Function *> Versioned;
+    for (auto &F : M) {
+        if (F.isDeclaration() || F.hasLocalLinkage())
+            continue;
+        DominatorTree DT(F);
+        LoopInfo LI(DT);
+        if (!LI.empty())
+            Versioned.push_back(&F);
+    }
+    if (Versioned.empty())
+        return true;
+
+    // Versions[V][I] is Versioned[I] for CPUs[V], or the fallback after the
+    // last CPU. All are declared before any is cloned, so that each version
+    // can call the others for its CPU.
+    LLVMContext &Ctx = M.getContext();
+    unsigned NumVersions = CPUs.size() + 1;
+    std::vector<std::vector<Function *>> Versions(NumVersions);
+    for (unsigned V = 0; V != NumVersions; ++V)
+        for (Function *F : Versioned)
+            Versions[V].push_back(Function::Create(
+                F->getFunctionType(), GlobalValue::InternalLinkage,
+                F->getName() + "." + (V < CPUs.size() ? CPUs[V] : "default"),
+                &M));
+    for (unsigned V = 0; V != NumVersions; ++V) {
+        ValueToValueMapTy VMap;
+        for (unsigned I = 0; I != Versioned.size(); ++I)
+            VMap[Versioned[I]] = Versions[V][I];
+        for (unsigned I = 0; I != Versioned.size(); ++I) {
+            Function *Version = Versions[V][I];
+            auto Arg = Version->arg_begin();
+            for (auto &A : Versioned[I]->args()) {
+                Arg->setName(A.getName());
+                VMap[&A] = &*Arg++;
+            }
+            SmallVector<ReturnInst *, 4> Returns;
+            CloneFunctionInto(Version, Versioned[I], VMap,
+                              /*ModuleLevelChanges=*/false, Returns);
+            Version->setLinkage(GlobalValue::InternalLinkage);
+            if (V < CPUs.size()) {
+                Version->addFnAttr("target-cpu", CPUs[V]);
+                Version->addFnAttr("target-features", Attrs);
+            }
+        }
+    }
+
+    // the fallback's until the constructor has run
+    Type *Int32Ty = Type::getInt32Ty(Ctx);
+    auto *Choice = new GlobalVariable(
+        M, Int32Ty, false, GlobalValue::InternalLinkage,
+        ConstantInt::get(Int32Ty, CPUs.size()), "__multiversion_choice");
+    emitVersionChoice(M, Choice, Masks);
+
+    for (unsigned I = 0; I != Versioned.size(); ++I) {
+        Function *F = Versioned[I];
+        F->deleteBody();
+        IRBuilder<> B(BasicBlock::Create(Ctx, "entry", F));
+        std::vector<Value *> Args;
+        for (auto &A : F->args())
+            Args.push_back(&A);
+        auto *Fallback = BasicBlock::Create(Ctx, "default", F);
+        auto *Switch = B.CreateSwitch(B.CreateLoad(Int32Ty, Choice, "choice"),
+                                      Fallback, CPUs.size());
+        for (unsigned V = 0; V != NumVersions; ++V) {
+            BasicBlock *BB = Fallback;
+            if (V < CPUs.size()) {
+                BB = BasicBlock::Create(Ctx, CPUs[V], F);
+                Switch->addCase(B.getInt32(V), BB);
+            }
+            B.SetInsertPoint(BB);
+            auto *Call = B.CreateCall(Versions[V][I], Args);
+            Call->setTailCall();
+            B.CreateRet(Call);
+        }
+    }
+    return true;
+}
+
+// runDriver - the command line compiler, run in main's session
+static int runDriver() {
+    // read a whole file if one was named, otherwise run as a REPL on stdin
+    if (InputFilename == "-")
+        State->Source->openStream(stdin);
+    else if (!State->Source->openFile(InputFilename))
+        return 1;
+
+    if (LexOnly) {
+        LexInput();
+        return 0;
+    }
+
+    if (ParseOnly) {
+        ParseInput();
+        return 0;
+    }
+
+    compileInput();
+
+    if (!BatchBench.empty())
+        BatchBenchmark();
+
+    if (PrintStats)
+        PrintStatistics();
 
     InitializeAllTargetInfos();
     InitializeAllTargets();
@@ -1213,8 +4901,11 @@ int main() {
     InitializeAllAsmParsers();
     InitializeAllAsmPrinters();
 
+    if (emitsDefinitions() && !linkDefinitions(*State->TheModule))
+        return 1;
+
     auto TargetTriple = sys::getDefaultTargetTriple();
-    TheModule->setTargetTriple(TargetTriple);
+    State->TheModule->setTargetTriple(TargetTriple);
 
     std::string Error;
     auto Target = TargetRegistry::lookupTarget(TargetTriple, Error);
@@ -1227,14 +4918,20 @@ int main() {
         return 1;
     }
 
-    auto CPU = "generic";
-    auto Features = "";
+    const CompilerOptions &Options = State->Options;
+    std::string CPU =
+        Options.MCPU.empty() ? "generic" : resolveCPU(Options.MCPU);
+    std::string Features = join(targetFeatures(Options), ",");
 
     TargetOptions opt;
     auto RM = Optional<Reloc::Model>();
     auto TargetMachine = Target->createTargetMachine(TargetTriple, CPU, Features, opt, RM);
 
-    TheModule->setDataLayout(TargetMachine->createDataLayout());
+    State->TheModule->setDataLayout(TargetMachine->createDataLayout());
+    if (!Options.Multiversion.empty() &&
+        !multiversionFunctions(*State->TheModule, *Target))
+        return 1;
+    runPipeline(*State->TheModule, TargetMachine, modulePipeline(Options));
 
     auto Filename = "output.o";
     std::error_code EC;
@@ -1253,10 +4950,20 @@ int main() {
         return 1;
     }
 
-    pass.run(*TheModule);
+    pass.run(*State->TheModule);
     dest.flush();
 
     outs() << "Wrote " << Filename << "\n";
 
     return 0;
 }
+
+int main(int argc, char **argv) {
+    cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope compiler\n");
+    if (!checkPipelineOptions(CommandLineOptions) ||
+        !checkMathOptions(CommandLineOptions))
+        return 1;
+
+    CompilerSession Session(CommandLineOptions);
+    return Session.withState(runDriver);
+}